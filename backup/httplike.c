@@ -9,6 +9,8 @@
 #include <sys/wait.h>
 #include "clib.h"
 #include "cnet.h"
+#include "evloop.h"
+#include "scan.h"
 
 // Message format:
 //
@@ -30,9 +32,10 @@
 typedef struct {
     int fd;
     float ver;
-    str_t *req;
-    array_t *args;
-    buf_t *body;
+    char *req;
+    int body_len;       // from body-length arg
+    char *body;         // NULL if no body, from the loop arena
+    hdrtbl_t args;
 } msg_t;
 
 typedef enum {
@@ -44,216 +47,242 @@ typedef enum {
 typedef struct {
     int fd;
     buf_t *buf;
-    int body_len;
     msgstate_t msgstate;
     msg_t *msg;
 } clientctx_t;
 
 msg_t *msg_new(int fd);
 void msg_free(msg_t *msg);
-void set_arg(array_t *args, char *arg_key, char *arg_val);
+void set_arg(msg_t *msg, char *k, size_t k_len, char *v, size_t v_len);
 void msg_print(msg_t *msg);
 
 clientctx_t *clientctx_new(int fd);
 void clientctx_free(clientctx_t *ctx);
-clientctx_t *find_clientctx(array_t *ctxs, int fd);
-void delete_clientctx(array_t *ctxs, int fd);
 
 void handle_sigint(int sig);
 void handle_sigchld(int sig);
 
+void on_listen_event(evloop_t *loop, int fd, int events, void *ctx);
+void on_client_event(evloop_t *loop, int fd, int events, void *ctx);
+void process_buf(clientctx_t *ctx);
+int process_line(clientctx_t *ctx, char *line, size_t line_len, int colon);
+void disconnect_client(int fd);
+
 void print_buf(buf_t *buf);
 
-fd_set _readfds;
-int _maxfd=0;
-array_t *_ctxs;
+evloop_t *_loop;
+pool_t *_ctxpool;
+pool_t *_msgpool;
+fdtbl_t *_ctxs;
 array_t *_pending_msgs;
 
+// Max lines found per scan_lines() call.
+#define LINES_BATCH 64
+
 int main(int argc, char *argv[]) {
-    int z;
     int s0;
     struct sockaddr sa;
     char *hostname = "localhost";
     char *port = "8001";
     str_t *serveripaddr = str_new(0);
-    str_t *strline = str_new(0);
-    int hasline = 0;
-    int hasbody = 0;
 
     signal(SIGPIPE, SIG_IGN);           // Don't abort on SIGPIPE
     signal(SIGINT, handle_sigint);      // exit on CTRL-C
     signal(SIGCHLD, handle_sigchld);
 
-    s0 = open_listen_sock(hostname, port, 50, &sa);
+    if (raise_fd_limit() == -1)
+        print_error("raise_fd_limit()");
+
+    s0 = open_listen_sock(hostname, port, SOMAXCONN, 0, &sa);
     if (s0 == -1) {
         print_error("open_listen_sock()");
         return 1;
     }
+    set_sock_nonblocking(s0);
     get_ipaddr_string(&sa, serveripaddr);
     printf("Listening on %s port %s...\n", serveripaddr->s, port);
 
-    FD_ZERO(&_readfds);
-    FD_SET(s0, &_readfds);
-    _maxfd = s0;
-
-    _ctxs = array_new(0, (voidpfunc_t) clientctx_free);
+    _ctxpool = pool_new("clientctx", sizeof(clientctx_t), 0);
+    _msgpool = pool_new("msg", sizeof(msg_t), 0);
+    _ctxs = fdtbl_new(0, (voidpfunc_t) clientctx_free);
     _pending_msgs = array_new(0, (voidpfunc_t) msg_free);
 
+    _loop = evloop_new();
+    if (_loop == NULL)
+        return 1;
+    if (evloop_add(_loop, s0, EV_READ, on_listen_event, NULL) == -1) {
+        print_error("evloop_add()");
+        return 1;
+    }
+    while (1) {
+        if (evloop_run_once(_loop, -1) == -1)
+            break;
+
+        // todo: Process _pending_msgs
+        // Bodies are gone with the loop arena at the next evloop_run_once().
+        array_clear(_pending_msgs);
+    }
+
+    evloop_free(_loop);
+    str_free(serveripaddr);
+    return 0;
+}
+
+// Accept all pending connections on listen socket.
+void on_listen_event(evloop_t *loop, int fd, int events, void *ctx) {
     while (1) {
-        fd_set readfds = _readfds;
-        z = select(_maxfd+1, &readfds, NULL, NULL, NULL);
-        if (z == -1 && errno == EINTR)
+        socklen_t sa_len = sizeof(struct sockaddr_in);
+        struct sockaddr_in sa;
+        int clientfd = accept(fd, (struct sockaddr*)&sa, &sa_len);
+        if (clientfd == -1 && errno == EINTR)
             continue;
-        if (z == -1) {
-            print_error("select()");
-            return 1;
+        if (clientfd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (clientfd == -1) {
+            print_error("accept()");
+            break;
         }
-        if (z == 0) // timeout
+        set_sock_nonblocking(clientfd);
+
+        // Add new client pipe
+        clientctx_t *clientctx = clientctx_new(clientfd);
+        if (evloop_add(loop, clientfd, EV_READ, on_client_event, clientctx) == -1) {
+            print_error("evloop_add()");
+            clientctx_free(clientctx);
+            close(clientfd);
             continue;
+        }
+        fdtbl_set(_ctxs, clientfd, clientctx);
+
+        printf("new clientfd: %d\n", clientfd);
+    }
+}
+
+// Client socket data available to read.
+// Watch is edge-triggered so keep reading until the socket blocks.
+void on_client_event(evloop_t *loop, int readfd, int events, void *pctx) {
+    clientctx_t *ctx = pctx;
+    assert(ctx != NULL);
+
+    while (1) {
+        int z = recv_buf(readfd, ctx->buf, 0, NULL);
+        if (z == Z_ERR)
+            print_error("recv_buf()");
+        process_buf(ctx);
+        if (z == Z_EOF || z == Z_ERR) {
+            disconnect_client(readfd);
+            return;
+        }
+        if (z == Z_BLOCK)
+            break;
+    }
+}
+
+// Parse all complete lines and bodies accumulated in ctx->buf.
+// Lines are found a batch at a time by scan_lines() and parsed in place,
+// each line's '\n' overwritten with '\0' so that it can be used as a C string.
+void process_buf(clientctx_t *ctx) {
+    buf_t *buf = ctx->buf;
+    linespan_t lines[LINES_BATCH];
 
-        for (int i=0; i <= _maxfd; i++) {
-            if (!FD_ISSET(i, &readfds))
-                continue;
-
-            // New connection, add client socket to readfds list.
-            if (i == s0) {
-                socklen_t sa_len = sizeof(struct sockaddr_in);
-                struct sockaddr_in sa;
-                int clientfd = accept(s0, (struct sockaddr*)&sa, &sa_len);
-                if (clientfd == -1) {
-                    print_error("accept()");
-                    continue;
-                }
-                // Add client socket to readfds list.
-                FD_SET(clientfd, &_readfds);
-                if (clientfd > _maxfd)
-                    _maxfd = clientfd;
-
-                // Add new client pipe
-                clientctx_t *ctx = clientctx_new(clientfd);
-                array_add(_ctxs, ctx);
-
-                printf("new clientfd: %d\n", clientfd);
-                continue;
-            } else {
-                // Client socket data available to read.
-                int readfd = i;
-                //printf("read data from clientfd %d\n", readfd);
-
-                clientctx_t *ctx = find_clientctx(_ctxs, readfd);
-                assert(ctx != NULL);
-
-                while (1) {
-                    if (ctx->msgstate == READING_HEAD) {
-                        assert(ctx->msg == NULL);
-
-                        z = recv_line(readfd, ctx->buf, 0, strline, &hasline);
-                        if (z == Z_ERR) {
-                            print_error("recv_line()");
-                        }
-                        if (z == Z_EOF) {
-                            FD_CLR(readfd, &_readfds);
-                            shutdown(readfd, SHUT_RD);
-                        }
-                        if (!hasline)
-                            break;
-
-                        // Request line format:
-                        // TH/{version} {request}
-                        // TH/0.1 login
-
-                        // Request line should start with "TH/", discard if doesn't match.
-                        if (strncmp(strline->s, "TH/", 3) != 0) {
-                            str_assign(strline, "");
-                            continue;
-                        }
-
-                        ctx->msg = msg_new(ctx->fd);
-
-                        char *pspace = strchr(strline->s, ' ');
-                        if (pspace != NULL) {
-                            *pspace = '\0';
-                            str_assign(ctx->msg->req, pspace+1);
-                        } else {
-                            str_assign(ctx->msg->req, "");
-                        }
-                        ctx->msg->ver = strtof(strline->s+3, NULL);
-                        str_assign(strline, "");
-                        ctx->msgstate = READING_ARGS;
-                        continue;
-                    }
-                    if (ctx->msgstate == READING_ARGS) {
-                        assert(ctx->msg != NULL);
-
-                        z = recv_line(readfd, ctx->buf, 0, strline, &hasline);
-                        if (z == Z_ERR) {
-                            print_error("recv_line()");
-                        }
-                        if (z == Z_EOF) {
-                            FD_CLR(readfd, &_readfds);
-                            shutdown(readfd, SHUT_RD);
-                        }
-                        if (!hasline)
-                            break;
-
-                        // Empty line read, no more args.
-                        if (strline->len == 0) {
-                            ctx->msgstate = READING_BODY;
-                            continue;
-                        }
-
-                        // Read one arg line: "key: val"
-                        char *k = strline->s;
-                        char *v = strchr(strline->s, ':');
-                        if (v == NULL)
-                            continue;
-
-                        // v points to ':', move to first char of val
-                        *v = '\0';
-                        v++;
-                        while (*v == ' ') {
-                            *v = '\0';
-                            v++;
-                        }
-                        set_arg(ctx->msg->args, k, v);
-                        if (strcmp(k, "body-length") == 0)
-                            ctx->body_len = atoi(v);
-                        continue;
-                    }
-                    if (ctx->msgstate == READING_BODY) {
-                        assert(ctx->msg != NULL);
-
-                        if (ctx->body_len > 0) {
-                            z = recv_bytes(readfd, ctx->buf, 0, ctx->body_len, ctx->msg->body, &hasbody);
-                            if (z == Z_ERR) {
-                                print_error("recv_buf()");
-                            }
-                            if (z == Z_EOF) {
-                                FD_CLR(readfd, &_readfds);
-                                shutdown(readfd, SHUT_RD);
-                            }
-                            if (!hasbody)
-                                break;
-                        }
-
-                        msg_print(ctx->msg);
-                        array_add(_pending_msgs, ctx->msg);
-
-                        ctx->msg = NULL;
-                        ctx->msgstate = READING_HEAD;
-                        continue;
-                    }
-                } // while (1)
+    while (1) {
+        if (ctx->msgstate == READING_BODY) {
+            msg_t *msg = ctx->msg;
+            assert(msg != NULL);
+            if (buf_datalen(buf) < msg->body_len)
+                return;
+            if (msg->body_len > 0) {
+                msg->body = arena_alloc(evloop_arena(_loop), msg->body_len+1);
+                memcpy(msg->body, buf_data(buf), msg->body_len);
+                msg->body[msg->body_len] = '\0';
+                buf_stripleft(buf, msg->body_len);
             }
-        } // for _maxfd
 
-        // todo: Process _pending_msgs
+            msg_print(ctx->msg);
+            array_add(_pending_msgs, ctx->msg);
+
+            ctx->msg = NULL;
+            ctx->msgstate = READING_HEAD;
+            continue;
+        }
 
-    } // while (1)
+        char *p = buf_data(buf);
+        size_t nlines = scan_lines(p, buf_datalen(buf), lines, LINES_BATCH);
+        if (nlines == 0)
+            return;
 
-    str_free(serveripaddr);
-    str_free(strline);
-    return 0;
+        // Lines after the end of args belong to the body, stop there and
+        // rescan after it.
+        size_t nconsumed = 0;
+        for (int i=0; i < nlines; i++) {
+            char *line = p + lines[i].off;
+            line[lines[i].len] = '\0';
+            nconsumed = lines[i].off + lines[i].len + 1;
+            if (process_line(ctx, line, lines[i].len, lines[i].colon) == READING_BODY)
+                break;
+        }
+        buf_stripleft(buf, nconsumed);
+    }
+}
+
+// Parse one line of a message. colon is the offset of the first ':' in line
+// or -1.
+// Returns the new message state.
+int process_line(clientctx_t *ctx, char *line, size_t line_len, int colon) {
+    if (ctx->msgstate == READING_HEAD) {
+        assert(ctx->msg == NULL);
+
+        // Request line format:
+        // TH/{version} {request}
+        // TH/0.1 login
+
+        // Request line should start with "TH/", discard if doesn't match.
+        if (strncmp(line, "TH/", 3) != 0)
+            return ctx->msgstate;
+
+        ctx->msg = msg_new(ctx->fd);
+
+        char *pspace = memchr(line, ' ', line_len);
+        if (pspace != NULL) {
+            *pspace = '\0';
+            ctx->msg->req = hdrtbl_strdup(&ctx->msg->args, pspace+1, line_len - (pspace+1 - line));
+        } else {
+            ctx->msg->req = hdrtbl_strdup(&ctx->msg->args, "", 0);
+        }
+        ctx->msg->ver = strtof(line+3, NULL);
+        ctx->msgstate = READING_ARGS;
+        return ctx->msgstate;
+    }
+
+    assert(ctx->msgstate == READING_ARGS);
+    assert(ctx->msg != NULL);
+
+    // Empty line read, no more args.
+    if (line_len == 0) {
+        ctx->msgstate = READING_BODY;
+        return ctx->msgstate;
+    }
+
+    // Read one arg line: "key: val"
+    if (colon < 0)
+        return ctx->msgstate;
+    char *k = line;
+    char *v = line + colon;
+
+    // v points to ':', move to first char of val
+    v++;
+    while (*v == ' ')
+        v++;
+    set_arg(ctx->msg, k, colon, v, line_len - (v - line));
+    return ctx->msgstate;
+}
+
+void disconnect_client(int fd) {
+    evloop_del(_loop, fd);
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+    fdtbl_del(_ctxs, fd);
+    printf("Disconnected client %d\n", fd);
 }
 
 void handle_sigint(int sig) {
@@ -270,96 +299,64 @@ void handle_sigchld(int sig) {
 }
 
 msg_t *msg_new(int fd) {
-    msg_t *msg = malloc(sizeof(msg_t));
+    msg_t *msg = pool_alloc(_msgpool);
     msg->fd = fd;
     msg->ver = 0.0;
-    msg->req = str_new(0);
-    msg->args = array_new(0, (voidpfunc_t) array_free);
-    msg->body = buf_new(0);
+    msg->req = "";
+    msg->body_len = 0;
+    msg->body = NULL;
+    hdrtbl_init(&msg->args);
     return msg;
 }
 void msg_free(msg_t *msg) {
-    str_free(msg->req);
-    array_free(msg->args);
-    buf_free(msg->body);
-    free(msg);
+    hdrtbl_fini(&msg->args);
+    pool_release(_msgpool, msg);
 }
-void set_arg(array_t *args, char *arg_key, char *arg_val) {
-    array_t *kv;
-    str_t *k, *v;
-
-    for (int i=0; i < args->len; i++) {
-        kv = (array_t *) args->items[i];
-        assert(kv->len == 2);
-        k = kv->items[0];
-        v = kv->items[1];
-
-        // Overwrite arg if it already exists.
-        if (strcmp(k->s, arg_key) == 0) {
-            str_assign(k, arg_key);
-            str_assign(v, arg_val);
-            return;
-        }
+// Set arg k (case-insensitive) to v, overwriting any existing value.
+// Keys and values are copied, so k and v may point into the read buffer.
+void set_arg(msg_t *msg, char *k, size_t k_len, char *v, size_t v_len) {
+    hdr_t *arg = hdrtbl_set(&msg->args, k, k_len, v, v_len);
+    if (arg == NULL) {
+        printf("Too many args, ignoring '%.*s'\n", (int) k_len, k);
+        return;
+    }
+
+    // Pick out well-known args as they're set so they need no lookup later.
+    if (arg->klen == 11 && memcmp(arg->k, "body-length", 11) == 0) {
+        msg->body_len = atoi(arg->v);
+        if (msg->body_len < 0)
+            msg->body_len = 0;
     }
-    // Add new arg.
-    k = str_new_assign(arg_key);
-    v = str_new_assign(arg_val);
-    kv = array_new(2, (voidpfunc_t) str_free);
-    array_add(kv, k);
-    array_add(kv, v);
-    array_add(args, kv);
 }
 void msg_print(msg_t *msg) {
     printf("MESSAGE:\n");
     printf("ver: %0.2f\n", msg->ver);
-    printf("req: '%s'\n", msg->req->s);
-    for (int i=0; i < msg->args->len; i++) {
-        array_t *arg = msg->args->items[i];
-        assert(arg->len == 2);
-        str_t *k = arg->items[0];
-        str_t *v = arg->items[1];
-        printf("[%s] => '%s'\n", k->s, v->s);
-    }
-    if (msg->body->len > 0) {
-        buf_append(msg->body, "\0", 1);
-        printf("body (%ld bytes): %s\n", msg->body->len-1, msg->body->p);
+    printf("req: '%s'\n", msg->req);
+    for (int i=0; i < msg->args.len; i++) {
+        hdr_t *arg = &msg->args.hdrs[i];
+        printf("[%s] => '%s'\n", arg->k, arg->v);
     }
+    if (msg->body != NULL)
+        printf("body (%d bytes): %s\n", msg->body_len, msg->body);
 }
 
 clientctx_t *clientctx_new(int fd) {
-    clientctx_t *ctx = malloc(sizeof(clientctx_t));
+    clientctx_t *ctx = pool_alloc(_ctxpool);
     ctx->fd = fd;
     ctx->buf = buf_new(0);
-    ctx->body_len = 0;
     ctx->msgstate = READING_HEAD;
     ctx->msg = NULL;
     return ctx;
 }
 void clientctx_free(clientctx_t *ctx) {
+    if (ctx->msg != NULL)
+        msg_free(ctx->msg);
     buf_free(ctx->buf);
-    free(ctx);
-}
-clientctx_t *find_clientctx(array_t *ctxs, int fd) {
-    for (int i=0; i < ctxs->len; i++) {
-        clientctx_t *ctx = (clientctx_t *) ctxs->items[i];
-        if (ctx->fd == fd)
-            return ctx;
-    }
-    return NULL;
-}
-void delete_clientctx(array_t *ctxs, int fd) {
-    for (int i=0; i < _ctxs->len; i++) {
-        clientctx_t *ctx = _ctxs->items[i];
-        if (ctx->fd == fd) {
-            array_del(_ctxs, i);
-            break;
-        }
-    }
+    pool_release(_ctxpool, ctx);
 }
-
 void print_buf(buf_t *buf) {
-    printf("buf (%ld bytes):", buf->len);
-    for (int i=0; i < buf->len; i++) {
+    printf("buf (%ld bytes):", buf_datalen(buf));
+    for (int i=buf->cur; i < buf->len; i++) {
         printf("%c", buf->p[i]);
     }
     printf("\n");
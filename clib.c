@@ -54,44 +54,123 @@ void buf_resize(buf_t *buf, size_t cap) {
     if (buf->len > buf->cap) {
         buf->len = buf->cap;
     }
-    if (buf->cur >= buf->len) {
-        buf->cur = buf->len-1;
+    if (buf->cur > buf->len) {
+        buf->cur = buf->len;
     }
     buf->p = realloc(buf->p, cap);
 }
 void buf_clear(buf_t *buf) {
-    memset(buf->p, 0, buf->len);
     buf->len = 0;
     buf->cur = 0;
 }
+// Move unconsumed bytes (cur..len) to start of buffer.
+void buf_compact(buf_t *buf) {
+    if (buf->cur == 0)
+        return;
+    size_t datalen = buf->len - buf->cur;
+    memmove(buf->p, buf->p + buf->cur, datalen);
+    buf->cur = 0;
+    buf->len = datalen;
+}
+// Make room for at least len more bytes past buf->len.
+// Consumed bytes at the front are reclaimed first if that frees enough
+// space, otherwise the buffer is grown geometrically.
+static void buf_grow(buf_t *buf, size_t len) {
+    if (buf->cur > 0 && len <= buf->cap - (buf->len - buf->cur)) {
+        buf_compact(buf);
+        return;
+    }
+    buf_compact(buf);
+
+    size_t newcap = buf->cap * 2;
+    if (newcap < buf->len + len)
+        newcap = buf->len + len;
+    char *p = realloc(buf->p, newcap);
+    if (p == NULL) {
+        panic("buf_grow() not enough memory");
+    }
+    buf->p = p;
+    buf->cap = newcap;
+}
 void buf_append(buf_t *buf, char *bs, size_t len) {
     // If not enough capacity to append bytes, expand the buffer.
-    if (len > buf->cap - buf->len) {
-        char *bs = realloc(buf->p, buf->cap + len);
-        if (bs == NULL) {
-            panic("buf_append() not enough memory");
-        }
-        buf->p = bs;
-        buf->cap += len;
-    }
+    if (len > buf->cap - buf->len)
+        buf_grow(buf, len);
     memcpy(buf->p + buf->len, bs, len);
     buf->len += len;
 }
+// Return pointer to at least len writable bytes at the end of buf.
+// Call buf_commit() afterwards with the number of bytes actually written.
+char *buf_reserve(buf_t *buf, size_t len) {
+    if (len > buf->cap - buf->len)
+        buf_grow(buf, len);
+    return buf->p + buf->len;
+}
+// Add len bytes written into space returned by buf_reserve() to buf.
+void buf_commit(buf_t *buf, size_t len) {
+    assert(len <= buf->cap - buf->len);
+    buf->len += len;
+}
+// Release excess capacity after a burst, keeping at least mincap bytes.
+// Buffer is only reallocated if it holds less than a quarter of its capacity.
+void buf_shrink(buf_t *buf, size_t mincap) {
+    size_t datalen = buf->len - buf->cur;
+    size_t newcap = datalen;
+    if (newcap < mincap)
+        newcap = mincap;
+    if (buf->cap <= newcap || datalen > buf->cap / 4)
+        return;
+    buf_compact(buf);
+    buf_resize(buf, newcap);
+}
+// Return offset of k in unconsumed bytes, relative to buf_data(), or -1.
 int buf_find(buf_t *buf, char *k, size_t k_len) {
-    char *p = memmem(buf->p, buf->len, k, k_len);
+    char *p = memmem(buf_data(buf), buf_datalen(buf), k, k_len);
     if (p == NULL)
         return -1;
-    return p - buf->p;
+    return p - buf_data(buf);
 }
+// Consume len bytes from the front of the buffer by advancing cur.
+// Bytes are not moved; the space is reclaimed by buf_grow() when needed.
 void buf_stripleft(buf_t *buf, size_t len) {
     if (len == 0)
         return;
-    if (len >= buf->len) {
+    if (len >= buf->len - buf->cur) {
         buf->len = 0;
+        buf->cur = 0;
         return;
     }
-    memcpy(buf->p, buf->p + len, buf->len - len);
-    buf->len = buf->len - len;
+    buf->cur += len;
+}
+// Remove len bytes from the end of unconsumed bytes.
+void buf_stripright(buf_t *buf, size_t len) {
+    assert(len <= buf->len - buf->cur);
+    buf->len -= len;
+}
+
+// Return new rbuf with room for len bytes and a refcount of 1.
+rbuf_t *rbuf_new(size_t len) {
+    rbuf_t *rb = malloc(sizeof(rbuf_t) + len);
+    if (rb == NULL)
+        panic("rbuf_new() out of memory");
+    rb->refcount = 1;
+    rb->len = len;
+    return rb;
+}
+rbuf_t *rbuf_new_copy(char *bs, size_t len) {
+    rbuf_t *rb = rbuf_new(len);
+    memcpy(rb->p, bs, len);
+    return rb;
+}
+rbuf_t *rbuf_ref(rbuf_t *rb) {
+    __atomic_add_fetch(&rb->refcount, 1, __ATOMIC_RELAXED);
+    return rb;
+}
+void rbuf_unref(rbuf_t *rb) {
+    int refcount = __atomic_sub_fetch(&rb->refcount, 1, __ATOMIC_ACQ_REL);
+    assert(refcount >= 0);
+    if (refcount == 0)
+        free(rb);
 }
 
 str_t *str_new(size_t cap) {
@@ -122,16 +201,19 @@ void str_assign(str_t *str, const char *s) {
     size_t s_len = strlen(s);
     if (s_len+1 > str->cap) {
         str->cap *= 2;
+        if (s_len+1 > str->cap)
+            str->cap = s_len+1;
         str->s = (char*) realloc(str->s, str->cap);
     }
 
-    strncpy(str->s, s, s_len);
-    str->s[s_len] = 0;
+    memcpy(str->s, s, s_len+1);
     str->len = s_len;
 }
 void str_assign_bytes(str_t *str, const char *bs, size_t len) {
     if (len+1 > str->cap) {
         str->cap *= 2;
+        if (len+1 > str->cap)
+            str->cap = len+1;
         str->s = (char*) realloc(str->s, str->cap);
     }
 
@@ -160,7 +242,7 @@ void str_append(str_t *str, const char *s) {
         str->s = realloc(str->s, str->cap);
     }
 
-    strncpy(str->s + str->len, s, s_len);
+    memcpy(str->s + str->len, s, s_len+1);
     str->len = str->len + s_len;
 }
 
@@ -206,10 +288,467 @@ void array_add(array_t *a, void *p) {
     a->len++;
 }
 void array_del(array_t *a, uint idx) {
-    for (size_t i=idx; i < a->len-1; i++) {
-        clear_item(a, i);
-        a->items[i] = a->items[i+1];
-    }
+    assert(idx < a->len);
+    clear_item(a, idx);
+    memmove(a->items + idx, a->items + idx+1, (a->len - idx-1) * sizeof(void*));
     a->len--;
 }
 
+fdtbl_t *fdtbl_new(size_t cap, voidpfunc_t clear_item_func) {
+    if (cap == 0)
+        cap = SIZE_SMALL;
+    fdtbl_t *t = (fdtbl_t*) malloc(sizeof(fdtbl_t));
+    t->slots = (fdslot_t*) malloc(sizeof(fdslot_t) * cap);
+    for (size_t i=0; i < cap; i++) {
+        t->slots[i].item = NULL;
+        t->slots[i].idx = -1;
+    }
+    t->slots_cap = cap;
+    t->fds = (int*) malloc(sizeof(int) * cap);
+    t->len = 0;
+    t->fds_cap = cap;
+    t->clear_item_func = clear_item_func;
+    return t;
+}
+void fdtbl_free(fdtbl_t *t) {
+    fdtbl_clear(t);
+    free(t->slots);
+    free(t->fds);
+    free(t);
+}
+void fdtbl_clear(fdtbl_t *t) {
+    while (t->len > 0)
+        fdtbl_del(t, t->fds[t->len-1]);
+}
+static void fdtbl_resize_slots(fdtbl_t *t, int fd) {
+    size_t newcap = t->slots_cap;
+    while (newcap <= fd)
+        newcap *= 2;
+    fdslot_t *p = (fdslot_t*) realloc(t->slots, sizeof(fdslot_t) * newcap);
+    if (p == NULL)
+        panic("fdtbl_resize_slots() out of memory");
+    for (size_t i=t->slots_cap; i < newcap; i++) {
+        p[i].item = NULL;
+        p[i].idx = -1;
+    }
+    t->slots = p;
+    t->slots_cap = newcap;
+}
+// Set item for fd, replacing (and clearing) any existing item.
+void fdtbl_set(fdtbl_t *t, int fd, void *p) {
+    assert(fd >= 0);
+    if (fd >= t->slots_cap)
+        fdtbl_resize_slots(t, fd);
+
+    fdslot_t *slot = &t->slots[fd];
+    if (slot->idx >= 0) {
+        if (t->clear_item_func != NULL && slot->item != p)
+            (*t->clear_item_func)(slot->item);
+        slot->item = p;
+        return;
+    }
+
+    if (t->len >= t->fds_cap) {
+        int *fds = (int*) realloc(t->fds, sizeof(int) * t->fds_cap * 2);
+        if (fds == NULL)
+            panic("fdtbl_set() out of memory");
+        t->fds = fds;
+        t->fds_cap *= 2;
+    }
+    slot->item = p;
+    slot->idx = t->len;
+    t->fds[t->len] = fd;
+    t->len++;
+}
+// Return item for fd or NULL if none.
+void *fdtbl_get(fdtbl_t *t, int fd) {
+    if (fd < 0 || fd >= t->slots_cap)
+        return NULL;
+    return t->slots[fd].item;
+}
+// Remove and clear item for fd.
+// The last fd in the dense list is moved into the vacated position.
+void fdtbl_del(fdtbl_t *t, int fd) {
+    if (fd < 0 || fd >= t->slots_cap)
+        return;
+    fdslot_t *slot = &t->slots[fd];
+    if (slot->idx < 0)
+        return;
+
+    int lastfd = t->fds[t->len-1];
+    t->fds[slot->idx] = lastfd;
+    t->slots[lastfd].idx = slot->idx;
+    t->len--;
+
+    void *item = slot->item;
+    slot->item = NULL;
+    slot->idx = -1;
+    if (t->clear_item_func != NULL)
+        (*t->clear_item_func)(item);
+}
+
+mpscq_t *mpscq_new() {
+    mpscq_t *q = (mpscq_t*) malloc(sizeof(mpscq_t));
+    q->stub.next = NULL;
+    q->stub.item = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+    return q;
+}
+// Free queue. Any remaining items are not freed.
+void mpscq_free(mpscq_t *q) {
+    while (mpscq_pop(q) != NULL) {
+    }
+    free(q);
+}
+static void mpscq_push_node(mpscq_t *q, mpscq_node_t *n) {
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    mpscq_node_t *prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+void mpscq_push(mpscq_t *q, void *item) {
+    assert(item != NULL);
+    mpscq_node_t *n = malloc(sizeof(mpscq_node_t));
+    if (n == NULL)
+        panic("mpscq_push() out of memory");
+    n->item = item;
+    mpscq_push_node(q, n);
+}
+// Return next item or NULL if queue is empty.
+// A producer that has swapped head but not yet linked its node is waited
+// on, so NULL always means the queue was empty.
+void *mpscq_pop(mpscq_t *q) {
+    mpscq_node_t *tail = q->tail;
+    mpscq_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+                return NULL;
+            while ((next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)) == NULL) {
+            }
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next == NULL) {
+        if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail) {
+            // tail is the last node, put stub behind it so it can be taken.
+            mpscq_push_node(q, &q->stub);
+        }
+        while ((next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)) == NULL) {
+        }
+    }
+    q->tail = next;
+
+    void *item = tail->item;
+    free(tail);
+    return item;
+}
+
+// Each slab starts with a pointer to the next slab followed by its items.
+#define SLAB_HEADER_LEN sizeof(void*)
+
+pool_t *pool_new(const char *name, size_t itemsize, size_t items_per_slab) {
+    if (items_per_slab == 0)
+        items_per_slab = 64;
+    // Free items hold the next free pointer, and items stay pointer aligned.
+    if (itemsize < sizeof(void*))
+        itemsize = sizeof(void*);
+    itemsize = (itemsize + sizeof(void*)-1) & ~(sizeof(void*)-1);
+
+    pool_t *pool = (pool_t*) malloc(sizeof(pool_t));
+    pool->name = name;
+    pool->itemsize = itemsize;
+    pool->items_per_slab = items_per_slab;
+    pool->freelist = NULL;
+    pool->slabs = NULL;
+    pool->nslabs = 0;
+    pool->nitems = 0;
+    pool->nused = 0;
+    pool->peak = 0;
+    return pool;
+}
+void pool_free(pool_t *pool) {
+    void *slab = pool->slabs;
+    while (slab != NULL) {
+        void *next = *(void**) slab;
+        free(slab);
+        slab = next;
+    }
+    free(pool);
+}
+static void pool_add_slab(pool_t *pool) {
+    char *slab = malloc(SLAB_HEADER_LEN + pool->itemsize * pool->items_per_slab);
+    if (slab == NULL)
+        panic("pool_add_slab() out of memory");
+    *(void**) slab = pool->slabs;
+    pool->slabs = slab;
+    pool->nslabs++;
+    pool->nitems += pool->items_per_slab;
+
+    // Thread the new items onto the free list.
+    char *item = slab + SLAB_HEADER_LEN;
+    for (size_t i=0; i < pool->items_per_slab; i++) {
+        *(void**) item = pool->freelist;
+        pool->freelist = item;
+        item += pool->itemsize;
+    }
+}
+void *pool_alloc(pool_t *pool) {
+    if (pool->freelist == NULL)
+        pool_add_slab(pool);
+    void *p = pool->freelist;
+    pool->freelist = *(void**) p;
+    pool->nused++;
+    if (pool->nused > pool->peak)
+        pool->peak = pool->nused;
+    return p;
+}
+void pool_release(pool_t *pool, void *p) {
+    if (p == NULL)
+        return;
+    assert(pool->nused > 0);
+    *(void**) p = pool->freelist;
+    pool->freelist = p;
+    pool->nused--;
+}
+// Append one line of occupancy statistics to out.
+void pool_print_stats(pool_t *pool, str_t *out) {
+    char line[256];
+    snprintf(line, sizeof(line), "pool %s: itemsize=%ld used=%ld peak=%ld items=%ld slabs=%ld\n",
+             pool->name, pool->itemsize, pool->nused, pool->peak, pool->nitems, pool->nslabs);
+    str_append(out, line);
+}
+
+struct arena_chunk {
+    arena_chunk_t *next;
+    size_t len;
+    size_t cap;
+    char p[];
+};
+
+static arena_chunk_t *arena_chunk_new(size_t cap) {
+    arena_chunk_t *c = malloc(sizeof(arena_chunk_t) + cap);
+    if (c == NULL)
+        panic("arena_chunk_new() out of memory");
+    c->next = NULL;
+    c->len = 0;
+    c->cap = cap;
+    return c;
+}
+arena_t *arena_new(size_t chunksize) {
+    if (chunksize == 0)
+        chunksize = SIZE_MEDIUM;
+    arena_t *a = (arena_t*) malloc(sizeof(arena_t));
+    a->chunksize = chunksize;
+    a->chunks = arena_chunk_new(chunksize);
+    a->nused = 0;
+    a->peak = 0;
+    return a;
+}
+void arena_free(arena_t *a) {
+    arena_chunk_t *c = a->chunks;
+    while (c != NULL) {
+        arena_chunk_t *next = c->next;
+        free(c);
+        c = next;
+    }
+    free(a);
+}
+// Return len bytes of pointer aligned memory, valid until arena_reset().
+void *arena_alloc(arena_t *a, size_t len) {
+    len = (len + sizeof(void*)-1) & ~(sizeof(void*)-1);
+
+    arena_chunk_t *c = a->chunks;
+    if (len > c->cap - c->len) {
+        size_t cap = a->chunksize;
+        if (cap < len)
+            cap = len;
+        c = arena_chunk_new(cap);
+        c->next = a->chunks;
+        a->chunks = c;
+    }
+    void *p = c->p + c->len;
+    c->len += len;
+    a->nused += len;
+    if (a->nused > a->peak)
+        a->peak = a->nused;
+    return p;
+}
+// Release all allocations. Overflow chunks are freed and only the
+// last (original) chunk is kept for reuse.
+void arena_reset(arena_t *a) {
+    arena_chunk_t *c = a->chunks;
+    while (c->next != NULL) {
+        arena_chunk_t *next = c->next;
+        free(c);
+        c = next;
+    }
+    c->len = 0;
+    a->chunks = c;
+    a->nused = 0;
+}
+
+void hdrtbl_init(hdrtbl_t *t) {
+    t->len = 0;
+    memset(t->slots, 0, sizeof(t->slots));
+    t->storelen = 0;
+    t->overflow = NULL;
+}
+// Free overflow memory. Table can be reused after hdrtbl_init().
+void hdrtbl_fini(hdrtbl_t *t) {
+    if (t->overflow != NULL)
+        arena_free(t->overflow);
+    t->overflow = NULL;
+}
+// Return NUL terminated copy of len bytes of s, valid until hdrtbl_fini().
+char *hdrtbl_strdup(hdrtbl_t *t, const char *s, size_t len) {
+    char *p;
+    if (len + 1 <= HDRTBL_STORE - t->storelen) {
+        p = t->store + t->storelen;
+        t->storelen += len + 1;
+    } else {
+        if (t->overflow == NULL)
+            t->overflow = arena_new(0);
+        p = arena_alloc(t->overflow, len + 1);
+    }
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+static inline char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+// FNV-1a of lowercased key.
+static uint32_t hdr_hash(const char *k, size_t klen) {
+    uint32_t h = 2166136261u;
+    for (size_t i=0; i < klen; i++) {
+        h ^= (uint8_t) lower(k[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+static int hdr_keyeq(hdr_t *hdr, const char *k, size_t klen) {
+    if (hdr->klen != klen)
+        return 0;
+    for (size_t i=0; i < klen; i++) {
+        if (hdr->k[i] != lower(k[i]))
+            return 0;
+    }
+    return 1;
+}
+// Return slot of key k, or of the empty slot where it would go.
+static size_t hdrtbl_slot(hdrtbl_t *t, const char *k, size_t klen, uint32_t hash) {
+    size_t i = hash & (HDRTBL_SLOTS-1);
+    while (t->slots[i] != 0) {
+        hdr_t *hdr = &t->hdrs[t->slots[i]-1];
+        if (hdr->hash == hash && hdr_keyeq(hdr, k, klen))
+            break;
+        i = (i + 1) & (HDRTBL_SLOTS-1);
+    }
+    return i;
+}
+// Set header k to v, overwriting any existing value.
+// Returns the header or NULL if table is full.
+hdr_t *hdrtbl_set(hdrtbl_t *t, const char *k, size_t klen, const char *v, size_t vlen) {
+    uint32_t hash = hdr_hash(k, klen);
+    size_t i = hdrtbl_slot(t, k, klen, hash);
+
+    hdr_t *hdr;
+    if (t->slots[i] != 0) {
+        hdr = &t->hdrs[t->slots[i]-1];
+    } else {
+        if (t->len == HDRTBL_MAX)
+            return NULL;
+        hdr = &t->hdrs[t->len];
+        t->len++;
+        t->slots[i] = t->len;
+
+        hdr->k = hdrtbl_strdup(t, k, klen);
+        for (size_t j=0; j < klen; j++)
+            hdr->k[j] = lower(hdr->k[j]);
+        hdr->hash = hash;
+        hdr->klen = klen;
+    }
+    // A replaced value's space is not reclaimed until hdrtbl_fini().
+    hdr->v = hdrtbl_strdup(t, v, vlen);
+    hdr->vlen = vlen;
+    return hdr;
+}
+// Return header k (any case) or NULL if not set.
+hdr_t *hdrtbl_get(hdrtbl_t *t, const char *k, size_t klen) {
+    size_t i = hdrtbl_slot(t, k, klen, hdr_hash(k, klen));
+    if (t->slots[i] == 0)
+        return NULL;
+    return &t->hdrs[t->slots[i]-1];
+}
+
+static int hist_bucket(uint64_t v) {
+    if (v < HIST_SUBBUCKETS)
+        return v;
+    int e = 63 - __builtin_clzll(v);
+    int sub = (v >> (e - HIST_SUBBITS)) & (HIST_SUBBUCKETS-1);
+    return (e - HIST_SUBBITS + 1) * HIST_SUBBUCKETS + sub;
+}
+// Highest value that falls in bucket i.
+static uint64_t hist_bucket_max(int i) {
+    if (i < HIST_SUBBUCKETS)
+        return i;
+    int e = i / HIST_SUBBUCKETS + HIST_SUBBITS - 1;
+    uint64_t sub = i % HIST_SUBBUCKETS;
+    return ((HIST_SUBBUCKETS + sub + 1) << (e - HIST_SUBBITS)) - 1;
+}
+
+void hist_clear(hist_t *h) {
+    memset(h, 0, sizeof(hist_t));
+}
+// Record v. Stores are atomic (but not read-modify-write, as there is a
+// single writer) so that readers never see torn counts.
+void hist_record(hist_t *h, uint64_t v) {
+    int i = hist_bucket(v);
+    __atomic_store_n(&h->counts[i], h->counts[i]+1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count+1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum+v, __ATOMIC_RELAXED);
+    if (v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+// Add counts of src to dst.
+void hist_merge(hist_t *dst, hist_t *src) {
+    for (int i=0; i < HIST_NBUCKETS; i++)
+        dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max)
+        dst->max = max;
+}
+// Return value at percentile pct (0-100), rounded up to its bucket.
+uint64_t hist_percentile(hist_t *h, double pct) {
+    uint64_t total = 0;
+    for (int i=0; i < HIST_NBUCKETS; i++)
+        total += h->counts[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (pct / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t n = 0;
+    for (int i=0; i < HIST_NBUCKETS; i++) {
+        n += h->counts[i];
+        if (n >= rank) {
+            uint64_t v = hist_bucket_max(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Monotonic clock in nanoseconds.
+uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -1,16 +1,20 @@
 #ifndef CLIB_H
 #define CLIB_H
 
+#include <stdint.h>
+
 #define countof(v) (sizeof(v) / sizeof((v)[0]))
 #define memzero(p, v) (memset(p, 0, sizeof(v)))
 
-#define SIZE_MB      1024*1024
+#define SIZE_MB      (1024*1024)
 #define SIZE_TINY    512
 #define SIZE_SMALL   1024
 #define SIZE_MEDIUM  32768
 #define SIZE_LARGE   (1024*1024)
 #define SIZE_HUGE    (1024*1024*1024)
 
+// Byte buffer used as a queue: bytes are appended at len and consumed
+// from cur. Unconsumed bytes are p[cur..len).
 typedef struct {
     char *p;
     size_t cur;
@@ -18,12 +22,24 @@ typedef struct {
     size_t cap;
 } buf_t;
 
+#define buf_data(buf)    ((buf)->p + (buf)->cur)
+#define buf_datalen(buf) ((buf)->len - (buf)->cur)
+
 typedef struct {
     char *s;
     size_t len;
     size_t cap;
 } str_t;
 
+// Reference counted byte block, shared read-only once filled in.
+// Freed when the last reference is dropped with rbuf_unref().
+// The refcount is atomic so an rbuf may be shared between threads.
+typedef struct {
+    int refcount;
+    size_t len;
+    char p[];
+} rbuf_t;
+
 typedef void (*voidpfunc_t)(void *);
 typedef struct {
     void **items;
@@ -32,6 +48,97 @@ typedef struct {
     voidpfunc_t clear_item_func;
 } array_t;
 
+// Table of items indexed by fd with O(1) get/set/del.
+// Occupied fds are also kept in a dense list (fds[0..len-1]) for iteration.
+typedef struct {
+    void *item;
+    int idx;            // index into fds list, -1 if slot empty
+} fdslot_t;
+typedef struct {
+    fdslot_t *slots;
+    size_t slots_cap;
+    int *fds;
+    size_t len;
+    size_t fds_cap;
+    voidpfunc_t clear_item_func;
+} fdtbl_t;
+
+// Lock-free multi-producer single-consumer queue of pointers
+// (Vyukov intrusive MPSC queue). Any thread may mpscq_push(), only the
+// owning thread may mpscq_pop().
+typedef struct mpscq_node {
+    struct mpscq_node *next;
+    void *item;
+} mpscq_node_t;
+typedef struct {
+    mpscq_node_t *head;     // last pushed node, swapped in by producers
+    mpscq_node_t *tail;     // next node to pop, owned by consumer
+    mpscq_node_t stub;
+} mpscq_t;
+
+// Fixed-size item allocator. Items are carved out of slabs of
+// items_per_slab items and recycled through a free list.
+// Slabs are not returned to the system until pool_free().
+typedef struct {
+    const char *name;
+    size_t itemsize;
+    size_t items_per_slab;
+    void *freelist;
+    void *slabs;        // linked list of slabs
+    size_t nslabs;
+    size_t nitems;      // total items in all slabs
+    size_t nused;       // items currently allocated
+    size_t peak;        // highest nused seen
+} pool_t;
+
+// Bump allocator for short-lived allocations that are all released
+// together by arena_reset().
+typedef struct arena_chunk arena_chunk_t;
+typedef struct {
+    arena_chunk_t *chunks;  // current chunk first
+    size_t chunksize;
+    size_t nused;           // bytes allocated since last reset
+    size_t peak;
+} arena_t;
+
+// Small table of message headers, meant to be embedded in a message.
+// Keys are stored lowercased and looked up case-insensitively through an
+// open addressed hash index. Keys and values are copied into the inline
+// store; only what doesn't fit goes to an arena created on first
+// overflow, so typical messages need no allocations at all.
+#define HDRTBL_MAX      32                  // max headers per table
+#define HDRTBL_SLOTS    (HDRTBL_MAX * 2)    // hash index size, power of 2
+#define HDRTBL_STORE    2048                // inline bytes for keys and values
+typedef struct {
+    char *k;
+    char *v;
+    uint32_t hash;
+    uint32_t klen;
+    uint32_t vlen;
+} hdr_t;
+typedef struct {
+    hdr_t hdrs[HDRTBL_MAX];     // in insertion order
+    size_t len;
+    uint8_t slots[HDRTBL_SLOTS];    // index into hdrs + 1, 0 for empty slot
+    size_t storelen;
+    arena_t *overflow;
+    char store[HDRTBL_STORE];
+} hdrtbl_t;
+
+// Log-linear histogram of uint64 values (HDR style). Values are bucketed
+// by power of 2, each split into HIST_SUBBUCKETS linear sub-buckets, so
+// a recorded value is known to within 1/HIST_SUBBUCKETS of itself.
+// One thread records; other threads may read it (hist_merge) at any time.
+#define HIST_SUBBITS    4
+#define HIST_SUBBUCKETS (1 << HIST_SUBBITS)
+#define HIST_NBUCKETS   ((64 - HIST_SUBBITS + 1) * HIST_SUBBUCKETS)
+typedef struct {
+    uint64_t counts[HIST_NBUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} hist_t;
+
 void quit(const char *s);
 void print_error(const char *s);
 void panic(const char *s);
@@ -41,9 +148,19 @@ buf_t *buf_new(size_t cap);
 void buf_free(buf_t *buf);
 void buf_resize(buf_t *buf, size_t cap);
 void buf_clear(buf_t *buf);
+void buf_compact(buf_t *buf);
 void buf_append(buf_t *buf, char *bs, size_t len);
+char *buf_reserve(buf_t *buf, size_t len);
+void buf_commit(buf_t *buf, size_t len);
+void buf_shrink(buf_t *buf, size_t mincap);
 int buf_find(buf_t *buf, char *k, size_t k_len);
 void buf_stripleft(buf_t *buf, size_t len);
+void buf_stripright(buf_t *buf, size_t len);
+
+rbuf_t *rbuf_new(size_t len);
+rbuf_t *rbuf_new_copy(char *bs, size_t len);
+rbuf_t *rbuf_ref(rbuf_t *rb);
+void rbuf_unref(rbuf_t *rb);
 
 str_t *str_new(size_t cap);
 void str_free(str_t *str);
@@ -60,5 +177,41 @@ void array_resize(array_t *a, size_t newcap);
 void array_add(array_t *a, void *p);
 void array_del(array_t *a, uint idx);
 
+fdtbl_t *fdtbl_new(size_t cap, voidpfunc_t clear_item_func);
+void fdtbl_free(fdtbl_t *t);
+void fdtbl_clear(fdtbl_t *t);
+void fdtbl_set(fdtbl_t *t, int fd, void *p);
+void *fdtbl_get(fdtbl_t *t, int fd);
+void fdtbl_del(fdtbl_t *t, int fd);
+
+mpscq_t *mpscq_new();
+void mpscq_free(mpscq_t *q);
+void mpscq_push(mpscq_t *q, void *item);
+void *mpscq_pop(mpscq_t *q);
+
+pool_t *pool_new(const char *name, size_t itemsize, size_t items_per_slab);
+void pool_free(pool_t *pool);
+void *pool_alloc(pool_t *pool);
+void pool_release(pool_t *pool, void *p);
+void pool_print_stats(pool_t *pool, str_t *out);
+
+arena_t *arena_new(size_t chunksize);
+void arena_free(arena_t *a);
+void *arena_alloc(arena_t *a, size_t len);
+void arena_reset(arena_t *a);
+
+void hdrtbl_init(hdrtbl_t *t);
+void hdrtbl_fini(hdrtbl_t *t);
+char *hdrtbl_strdup(hdrtbl_t *t, const char *s, size_t len);
+hdr_t *hdrtbl_set(hdrtbl_t *t, const char *k, size_t klen, const char *v, size_t vlen);
+hdr_t *hdrtbl_get(hdrtbl_t *t, const char *k, size_t klen);
+
+void hist_clear(hist_t *h);
+void hist_record(hist_t *h, uint64_t v);
+void hist_merge(hist_t *dst, hist_t *src);
+uint64_t hist_percentile(hist_t *h, double pct);
+
+uint64_t clock_ns();
+
 #endif
 
@@ -7,12 +7,46 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+#include <limits.h>
 #include "clib.h"
 #include "cnet.h"
 
-// Number of bytes to send/recv at a time.
-//#define NET_BUFSIZE 512
-#define NET_BUFSIZE 4
+// Default number of bytes to recv at a time. See set_net_readsize().
+size_t _net_readsize = NET_READSIZE;
+
+void set_net_readsize(size_t readsize) {
+    if (readsize == 0)
+        readsize = NET_READSIZE;
+    _net_readsize = readsize;
+}
+
+// Do one recv() of up to len bytes directly into the end of buf.
+// Returns number of bytes received (> 0) or one of the following:
+//    0 (Z_EOF) for EOF
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for blocked socket (no data)
+static int recv_tail(int fd, buf_t *buf, size_t len) {
+    int z;
+    char *p = buf_reserve(buf, len);
+    while (1) {
+        z = recv(fd, p, len, MSG_DONTWAIT);
+        if (z == -1 && errno == EINTR)
+            continue;
+        break;
+    }
+    if (z == 0)
+        return Z_EOF;
+    if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return Z_BLOCK;
+    if (z == -1)
+        return Z_ERR;
+    buf_commit(buf, z);
+    return z;
+}
 
 // Cumulatively reads socket bytes into buffer.
 // Returns one of the following:
@@ -21,28 +55,11 @@
 //   -2 (Z_BLOCK) for blocked socket (no data)
 int recv_buf_flush(int fd, buf_t *buf) {
     int z;
-    char readbuf[NET_BUFSIZE];
     while (1) {
-        z = recv(fd, readbuf, sizeof(readbuf), MSG_DONTWAIT);
-        if (z == 0) {
-            z = Z_EOF;
+        z = recv_tail(fd, buf, _net_readsize);
+        if (z <= 0)
             break;
-        }
-        if (z == -1 && errno == EINTR) {
-            continue;
-        }
-        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            z = Z_BLOCK;
-            break;
-        }
-        if (z == -1) {
-            z = Z_ERR;
-            break;
-        }
-        assert(z > 0);
-        buf_append(buf, readbuf, z);
     }
-    assert(z <= 0);
     return z;
 }
 // Cumulatively write buffer bytes into socket.
@@ -80,6 +97,117 @@ int send_buf_flush(int fd, buf_t *buf) {
     return z;
 }
 
+outq_t *outq_new(size_t cap) {
+    if (cap == 0)
+        cap = 16;
+    outq_t *q = malloc(sizeof(outq_t));
+    q->items = malloc(sizeof(rbuf_t*) * cap);
+    q->stamps = malloc(sizeof(uint64_t) * cap);
+    q->head = 0;
+    q->count = 0;
+    q->cap = cap;
+    q->off = 0;
+    q->nbytes = 0;
+    q->latency = NULL;
+    return q;
+}
+void outq_free(outq_t *q) {
+    for (size_t i=0; i < q->count; i++)
+        rbuf_unref(q->items[(q->head + i) % q->cap]);
+    free(q->items);
+    free(q->stamps);
+    free(q);
+}
+// Queue rb to be sent. The queue takes its own reference to rb.
+void outq_push(outq_t *q, rbuf_t *rb) {
+    if (rb->len == 0)
+        return;
+    if (q->count == q->cap) {
+        // Grow ring, unwrapping items to start at index 0.
+        size_t newcap = q->cap * 2;
+        rbuf_t **items = malloc(sizeof(rbuf_t*) * newcap);
+        uint64_t *stamps = malloc(sizeof(uint64_t) * newcap);
+        if (items == NULL || stamps == NULL)
+            panic("outq_push() out of memory");
+        for (size_t i=0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) % q->cap];
+            stamps[i] = q->stamps[(q->head + i) % q->cap];
+        }
+        free(q->items);
+        free(q->stamps);
+        q->items = items;
+        q->stamps = stamps;
+        q->head = 0;
+        q->cap = newcap;
+    }
+    q->items[(q->head + q->count) % q->cap] = rbuf_ref(rb);
+    if (q->latency != NULL)
+        q->stamps[(q->head + q->count) % q->cap] = clock_ns();
+    q->count++;
+    q->nbytes += rb->len;
+}
+// Drop n sent bytes from front of queue.
+void outq_consume(outq_t *q, size_t n) {
+    uint64_t now = 0;
+    q->nbytes -= n;
+    while (n > 0) {
+        rbuf_t *rb = q->items[q->head];
+        size_t nleft = rb->len - q->off;
+        if (n < nleft) {
+            q->off += n;
+            return;
+        }
+        n -= nleft;
+        if (q->latency != NULL) {
+            if (now == 0)
+                now = clock_ns();
+            hist_record(q->latency, now - q->stamps[q->head]);
+        }
+        rbuf_unref(rb);
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        q->off = 0;
+    }
+}
+// Fill iov with up to maxiov unsent buffers from front of queue.
+// Returns number of iovecs filled.
+int outq_iov(outq_t *q, struct iovec *iov, int maxiov) {
+    int niov = 0;
+    for (size_t i=0; i < q->count && niov < maxiov; i++) {
+        rbuf_t *rb = q->items[(q->head + i) % q->cap];
+        size_t off = (i == 0) ? q->off : 0;
+        iov[niov].iov_base = rb->p + off;
+        iov[niov].iov_len = rb->len - off;
+        niov++;
+    }
+    return niov;
+}
+// Write queued buffers into socket, up to OUTQ_IOVMAX buffers per writev.
+// Returns one of the following:
+//    0 (Z_EOF) for all queued bytes sent
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for blocked socket (wait for writable and call again)
+int outq_flush(int fd, outq_t *q) {
+    struct iovec iov[OUTQ_IOVMAX];
+    struct msghdr mh;
+
+    while (q->count > 0) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = outq_iov(q, iov, OUTQ_IOVMAX);
+
+        ssize_t z = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (z == -1 && errno == EINTR)
+            continue;
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return Z_BLOCK;
+        if (z == -1)
+            return Z_ERR;
+        outq_consume(q, z);
+    }
+    return Z_EOF;
+}
+
 // Reads up to nbytes into buffer.
 // Returns one of the following:
 //    1 (Z_OPEN) for socket open (socket data available)
@@ -88,37 +216,16 @@ int send_buf_flush(int fd, buf_t *buf) {
 //   -2 (Z_BLOCK) for blocked socket (no socket data available)
 // On return, num_bytes_received contains the number of bytes read.
 int recv_buf(int fd, buf_t *buf, size_t nbytes, size_t *num_bytes_received) {
-    int z;
-    char readbuf[NET_BUFSIZE];
+    int z = Z_OPEN;
     size_t nread = 0;
 
     if (nbytes == 0)
-        nbytes = sizeof(readbuf);
+        nbytes = _net_readsize;
 
     while (nread < nbytes) {
-        // receive as much bytes as readbuf can hold
-        int nblock = nbytes-nread;
-        if (nblock > sizeof(readbuf))
-            nblock = sizeof(readbuf);
-
-        z = recv(fd, readbuf, nblock, MSG_DONTWAIT);
-        if (z == 0) {
-            z = Z_EOF;
-            break;
-        }
-        if (z == -1 && errno == EINTR) {
-            continue;
-        }
-        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            z = Z_BLOCK;
-            break;
-        }
-        if (z == -1) {
-            z = Z_ERR;
+        z = recv_tail(fd, buf, nbytes-nread);
+        if (z <= 0)
             break;
-        }
-        assert(z > 0);
-        buf_append(buf, readbuf, z);
         nread += z;
     }
     if (z > 0) {
@@ -129,38 +236,70 @@ int recv_buf(int fd, buf_t *buf, size_t nbytes, size_t *num_bytes_received) {
     return z;
 }
 
-int recv_line(int fd, buf_t *buf, size_t max_recv, str_t *out_line, int *complete) {
+// Reads into the free space at the end of buf, overflowing into spill,
+// using a single readv() call. Bytes that land in spill are then appended
+// to buf. This lets a small per-connection buffer drain a large burst in
+// one syscall without preallocating room for it.
+// Returns one of the following:
+//    1 (Z_OPEN) for socket open (both iovecs filled, more data may follow)
+//    0 (Z_EOF) for EOF
+//   -1 (Z_ERR) for error
+//   -2 (Z_BLOCK) for socket drained (short read or no data)
+// On return, num_bytes_received contains the number of bytes read.
+int recv_buf_readv(int fd, buf_t *buf, char *spill, size_t spill_len, size_t *num_bytes_received) {
     int z;
-    char readbuf[NET_BUFSIZE];
+    struct iovec iov[2];
+
+    // Reclaim consumed space when the unconsumed bytes are no bigger than it.
+    if (buf->cur > 0 && buf_datalen(buf) <= buf->cur)
+        buf_compact(buf);
+    size_t nfree = buf->cap - buf->len;
+
+    if (num_bytes_received != NULL)
+        *num_bytes_received = 0;
+
+    iov[0].iov_base = buf->p + buf->len;
+    iov[0].iov_len = nfree;
+    iov[1].iov_base = spill;
+    iov[1].iov_len = spill_len;
+    while (1) {
+        z = readv(fd, iov, 2);
+        if (z == -1 && errno == EINTR)
+            continue;
+        break;
+    }
+    if (z == 0)
+        return Z_EOF;
+    if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return Z_BLOCK;
+    if (z == -1)
+        return Z_ERR;
+
+    if (z <= nfree) {
+        buf_commit(buf, z);
+    } else {
+        buf_commit(buf, nfree);
+        buf_append(buf, spill, z - nfree);
+    }
+    if (num_bytes_received != NULL)
+        *num_bytes_received = z;
+
+    if (z < nfree + spill_len)
+        return Z_BLOCK;
+    return Z_OPEN;
+}
+
+int recv_line(int fd, buf_t *buf, size_t max_recv, str_t *out_line, int *complete) {
+    int z = Z_OPEN;
     size_t nread = 0;
 
     if (max_recv == 0)
-        max_recv = sizeof(readbuf);
+        max_recv = _net_readsize;
 
     while (nread < max_recv) {
-        // receive as much bytes as readbuf can hold
-        int nblock = max_recv-nread;
-        if (nblock > sizeof(readbuf))
-            nblock = sizeof(readbuf);
-
-        z = recv(fd, readbuf, nblock, MSG_DONTWAIT);
-        if (z == 0) {
-            z = Z_EOF;
-            break;
-        }
-        if (z == -1 && errno == EINTR) {
-            continue;
-        }
-        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            z = Z_BLOCK;
-            break;
-        }
-        if (z == -1) {
-            z = Z_ERR;
+        z = recv_tail(fd, buf, max_recv-nread);
+        if (z <= 0)
             break;
-        }
-        assert(z > 0);
-        buf_append(buf, readbuf, z);
         nread += z;
     }
     if (z > 0) {
@@ -182,21 +321,18 @@ int recv_line(int fd, buf_t *buf, size_t max_recv, str_t *out_line, int *complet
     // .
     // cur=0
     // len=1
-    for (int i=0; i < buf->len; i++) {
-        if (buf->p[i] == '\n') {
-            // return line read to out_line, excluding '\n'
-            buf->p[i] = '\0';
-            str_assign(out_line, buf->p);
-
-            // reset buf with the remaining chars to the right of '\n' 
-            int num_extrachars = buf->len - (i+1);
-            memcpy(buf->p, buf->p+i+1, num_extrachars);
-            buf->len = num_extrachars;
-            memset(buf->p + buf->len, 0, buf->cap - buf->len);
-
-            *complete = 1;
-            return z;
-        }
+    char *pnl = memchr(buf_data(buf), '\n', buf_datalen(buf));
+    if (pnl != NULL) {
+        int i = pnl - buf_data(buf);
+
+        // return line read to out_line, excluding '\n'
+        str_assign_bytes(out_line, buf_data(buf), i);
+
+        // consume line, leaving the remaining chars to the right of '\n'
+        buf_stripleft(buf, i+1);
+
+        *complete = 1;
+        return z;
     }
 
     *complete = 0;
@@ -213,52 +349,27 @@ int recv_line(int fd, buf_t *buf, size_t max_recv, str_t *out_line, int *complet
 //   nrecv bytes are moved from buf to outbuf and *complete set to 1.
 // If not enough accumulated bytes received (< nrecv), *complete set to 0.
 int recv_bytes(int fd, buf_t *buf, size_t max_recv, size_t nrecv, buf_t *outbuf, int *complete) {
-    int z;
-    char readbuf[NET_BUFSIZE];
+    int z = Z_OPEN;
     size_t nread = 0;
 
     if (max_recv == 0)
-        max_recv = sizeof(readbuf);
+        max_recv = _net_readsize;
 
     while (nread < max_recv) {
-        // receive as much bytes as readbuf can hold
-        int nblock = max_recv-nread;
-        if (nblock > sizeof(readbuf))
-            nblock = sizeof(readbuf);
-
-        z = recv(fd, readbuf, nblock, MSG_DONTWAIT);
-        if (z == 0) {
-            z = Z_EOF;
-            break;
-        }
-        if (z == -1 && errno == EINTR) {
-            continue;
-        }
-        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            z = Z_BLOCK;
-            break;
-        }
-        if (z == -1) {
-            z = Z_ERR;
+        z = recv_tail(fd, buf, max_recv-nread);
+        if (z <= 0)
             break;
-        }
-        assert(z > 0);
-        buf_append(buf, readbuf, z);
         nread += z;
     }
     if (z > 0) {
         z = Z_OPEN;
     }
 
-    if (buf->len >= nrecv) {
+    if (buf_datalen(buf) >= nrecv) {
         if (outbuf != NULL) {
             buf_clear(outbuf);
-            buf_append(outbuf, buf->p, nrecv);
-
-            int num_extrabytes = nrecv - buf->len;
-            memcpy(buf->p, buf->p + nrecv, num_extrabytes);
-            buf->len = num_extrabytes;
-            memset(buf->p + buf->len, 0, buf->cap - buf->len);
+            buf_append(outbuf, buf_data(buf), nrecv);
+            buf_stripleft(buf, nrecv);
         }
         *complete = 1;
         return z;
@@ -270,7 +381,10 @@ int recv_bytes(int fd, buf_t *buf, size_t max_recv, size_t nrecv, buf_t *outbuf,
 
 
 // Return new socket fd for listening or -1 for error.
-int open_listen_sock(char *host, char *port, int backlog, struct sockaddr *psa) {
+// With LISTEN_REUSEPORT flag, SO_REUSEPORT is set so that each thread can
+// open its own listening socket on the same port and the kernel spreads
+// incoming connections across them.
+int open_listen_sock(char *host, char *port, int backlog, int flags, struct sockaddr *psa) {
     int z;
 
     struct addrinfo hints, *ai;
@@ -300,6 +414,13 @@ int open_listen_sock(char *host, char *port, int backlog, struct sockaddr *psa)
         print_error("setsockopt()");
         goto error_return;
     }
+    if (flags & LISTEN_REUSEPORT) {
+        z = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+        if (z == -1) {
+            print_error("setsockopt(SO_REUSEPORT)");
+            goto error_return;
+        }
+    }
     z = bind(fd, ai->ai_addr, ai->ai_addrlen);
     if (z == -1) {
         print_error("bind()");
@@ -318,6 +439,30 @@ error_return:
     freeaddrinfo(ai);
     return z;
 }
+// Return new Unix domain stream socket fd listening at path or -1 for error.
+// A stale socket file left at path is removed first.
+int open_unix_listen_sock(const char *path, int backlog) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1 || listen(fd, backlog) == -1) {
+        int tmp_errno = errno;
+        close(fd);
+        errno = tmp_errno;
+        return -1;
+    }
+    return fd;
+}
 // Return new socket fd for sending/receiving or -1 for error.
 // You can specify the host and port in two ways:
 // 1. host="domain.xyz", port="5001" (separate host and port)
@@ -375,6 +520,30 @@ void set_sock_timeout(int sock, int nsecs, int ms) {
 void set_sock_nonblocking(int sock) {
     fcntl(sock, F_SETFL, O_NONBLOCK);
 }
+// Send small writes immediately instead of holding them back until
+// earlier data is acked (Nagle). Callers that coalesce their own writes
+// want this, or a small write can wait out the peer's delayed ack.
+// No-op on non-TCP sockets.
+void set_sock_nodelay(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+// Raise the open file limit to the hard maximum so that the number of
+// connections is not capped by the default soft limit (usually 1024).
+// Returns the new limit or -1 for error.
+int raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        return -1;
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            return -1;
+    }
+    if (rl.rlim_cur > INT_MAX)
+        return INT_MAX;
+    return (int) rl.rlim_cur;
+}
 // Return sin_addr or sin6_addr depending on address family.
 static void *sockaddr_sin_addr(struct sockaddr *sa) {
     // addr->ai_addr is either struct sockaddr_in* or sockaddr_in6* depending on ai_family
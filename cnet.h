@@ -7,6 +7,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #include "clib.h"
 
 // Function return values:
@@ -19,17 +20,58 @@
 #define Z_ERR -1
 #define Z_BLOCK -2
 
+// Default number of bytes to recv at a time.
+#define NET_READSIZE 16384
+
+// Size of spill buffer to pass to recv_buf_readv().
+#define NET_SPILLSIZE 65536
+
+// Max number of queued buffers written per writev() call.
+#define OUTQ_IOVMAX 64
+
+// Queue of outbound rbufs for one socket.
+// Buffers are held in a ring; off is the number of bytes of the
+// first buffer already sent and nbytes the total bytes still unsent.
+// If latency is set, the time each buffer spends queued (from
+// outq_push() until its last byte is sent) is recorded in it.
+typedef struct {
+    rbuf_t **items;
+    uint64_t *stamps;       // push time of each item, if latency set
+    size_t head;
+    size_t count;
+    size_t cap;
+    size_t off;
+    size_t nbytes;
+    hist_t *latency;
+} outq_t;
+
+void set_net_readsize(size_t readsize);
+
 int recv_buf_flush(int fd, buf_t *buf);
 int send_buf_flush(int fd, buf_t *buf);
 
 int recv_buf(int fd, buf_t *buf, size_t nbytes, size_t *num_bytes_received);
+int recv_buf_readv(int fd, buf_t *buf, char *spill, size_t spill_len, size_t *num_bytes_received);
 int recv_line(int fd, buf_t *buf, size_t max_recv, str_t *out_line, int *complete);
 int recv_bytes(int fd, buf_t *buf, size_t max_recv, size_t nrecv, buf_t *outbuf, int *complete);
 
-int open_listen_sock(char *host, char *port, int backlog, struct sockaddr *psa);
+outq_t *outq_new(size_t cap);
+void outq_free(outq_t *q);
+void outq_push(outq_t *q, rbuf_t *rb);
+int outq_iov(outq_t *q, struct iovec *iov, int maxiov);
+void outq_consume(outq_t *q, size_t n);
+int outq_flush(int fd, outq_t *q);
+
+// open_listen_sock() flags
+#define LISTEN_REUSEPORT 0x1    // allow several sockets to bind the same port
+
+int open_listen_sock(char *host, char *port, int backlog, int flags, struct sockaddr *psa);
+int open_unix_listen_sock(const char *path, int backlog);
 int open_connect_sock(char *host, char *port, struct sockaddr *psa);
 void set_sock_timeout(int sock, int nsecs, int ms);
 void set_sock_nonblocking(int sock);
+void set_sock_nodelay(int sock);
+int raise_fd_limit();
 unsigned short get_sockaddr_port(struct sockaddr *sa);
 void get_ipaddr_string(struct sockaddr *sa, str_t *ipaddr);
 
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__)
+#define CRC_X86
+#include <immintrin.h>
+#endif
+#include "crc32c.h"
+
+// Reflected Castagnoli polynomial.
+#define CRC32C_POLY 0x82f63b78
+
+typedef uint32_t (*crcfunc_t)(uint32_t crc, const uint8_t *p, size_t len);
+
+static int _impl;
+static crcfunc_t _crc;
+
+// _table[0] is the bytewise table; _table[k][b] is the crc of byte b
+// followed by k zero bytes, so that 8 bytes can be folded in at once.
+static uint32_t _table[8][256];
+
+static void init_tables() {
+    for (int b=0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int i=0; i < 8; i++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        _table[0][b] = crc;
+    }
+    for (int b=0; b < 256; b++) {
+        uint32_t crc = _table[0][b];
+        for (int k=1; k < 8; k++) {
+            crc = (crc >> 8) ^ _table[0][crc & 0xff];
+            _table[k][b] = crc;
+        }
+    }
+}
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = _table[7][lo & 0xff] ^ _table[6][(lo >> 8) & 0xff] ^
+              _table[5][(lo >> 16) & 0xff] ^ _table[4][lo >> 24] ^
+              _table[3][hi & 0xff] ^ _table[2][(hi >> 8) & 0xff] ^
+              _table[1][(hi >> 16) & 0xff] ^ _table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ _table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    return crc;
+}
+
+#ifdef CRC_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+// Use checksum impl. Returns 0 on success or -1 if the CPU doesn't
+// support impl.
+int crc_set_impl(int impl) {
+    if (impl == CRC_SLICE8) {
+        _crc = crc_slice8;
+#ifdef CRC_X86
+    } else if (impl == CRC_SSE42 && __builtin_cpu_supports("sse4.2")) {
+        _crc = crc_sse42;
+#endif
+    } else {
+        return -1;
+    }
+    _impl = impl;
+    return 0;
+}
+
+// Build tables and pick the best supported impl before main() runs, so
+// that threads never race on them.
+__attribute__((constructor))
+static void crc_init() {
+    init_tables();
+    __builtin_cpu_init();
+    if (crc_set_impl(CRC_SSE42) == 0)
+        return;
+    crc_set_impl(CRC_SLICE8);
+}
+
+int crc_impl() {
+    return _impl;
+}
+const char *crc_impl_name(int impl) {
+    if (impl == CRC_SSE42)
+        return "sse42";
+    return "slice8";
+}
+
+// Return CRC32C of p[0..len) continued from crc, the CRC32C of the bytes
+// before p (0 to start). Checksumming a message piece by piece as it
+// arrives gives the same result as checksumming it whole.
+uint32_t crc32c(uint32_t crc, const void *p, size_t len) {
+    return ~_crc(~crc, p, len);
+}
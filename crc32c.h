@@ -0,0 +1,22 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli) checksums.
+//
+// Computed with the SSE4.2 crc32 instruction when the CPU has it, else
+// with slice-by-8 tables. The choice is made at startup like scan.h's;
+// crc_set_impl() overrides it (for benchmarks and testing).
+
+#define CRC_SLICE8  0
+#define CRC_SSE42   1
+
+int crc_impl();
+const char *crc_impl_name(int impl);
+int crc_set_impl(int impl);
+
+uint32_t crc32c(uint32_t crc, const void *p, size_t len);
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include "clib.h"
+#include "evloop.h"
+
+evloop_t *evloop_new() {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        print_error("epoll_create1()");
+        return NULL;
+    }
+
+    evloop_t *loop = malloc(sizeof(evloop_t));
+    loop->epfd = epfd;
+    loop->watches_cap = SIZE_SMALL;
+    loop->watches = calloc(loop->watches_cap, sizeof(evwatch_t));
+    loop->nextgen = 0;
+    loop->running = 0;
+    loop->arena = arena_new(0);
+    return loop;
+}
+void evloop_free(evloop_t *loop) {
+    close(loop->epfd);
+    free(loop->watches);
+    arena_free(loop->arena);
+    free(loop);
+}
+
+// Grow watches table so that fd can be used as an index.
+static void ensure_watch(evloop_t *loop, int fd) {
+    if (fd < loop->watches_cap)
+        return;
+
+    size_t newcap = loop->watches_cap;
+    while (newcap <= fd)
+        newcap *= 2;
+    evwatch_t *p = realloc(loop->watches, newcap * sizeof(evwatch_t));
+    if (p == NULL)
+        panic("ensure_watch() out of memory");
+    memset(p + loop->watches_cap, 0, (newcap - loop->watches_cap) * sizeof(evwatch_t));
+    loop->watches = p;
+    loop->watches_cap = newcap;
+}
+
+static uint32_t to_epoll_events(int events) {
+    uint32_t epevents = EPOLLET | EPOLLRDHUP;
+    if (events & EV_READ)
+        epevents |= EPOLLIN;
+    if (events & EV_WRITE)
+        epevents |= EPOLLOUT;
+    return epevents;
+}
+
+// epoll data carries the fd and the generation of its registration, so
+// that an event queued for a closed fd isn't delivered to whichever watch
+// reuses that fd number later in the same batch.
+static inline uint64_t to_epoll_data(int fd, uint32_t gen) {
+    return (uint64_t) gen << 32 | (uint32_t) fd;
+}
+
+static int from_epoll_events(uint32_t epevents) {
+    int events = 0;
+    if (epevents & (EPOLLIN | EPOLLRDHUP))
+        events |= EV_READ;
+    if (epevents & EPOLLOUT)
+        events |= EV_WRITE;
+    if (epevents & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+        events |= EV_ERROR;
+    return events;
+}
+
+// Register fd with read/write interest. ctx is passed back to func.
+// Returns 0 on success, -1 for error (errno set).
+int evloop_add(evloop_t *loop, int fd, int events, evfunc_t func, void *ctx) {
+    assert(fd >= 0);
+    assert(func != NULL);
+
+    uint32_t gen = ++loop->nextgen;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll_events(events);
+    ev.data.u64 = to_epoll_data(fd, gen);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        return -1;
+
+    ensure_watch(loop, fd);
+    evwatch_t *w = &loop->watches[fd];
+    w->func = func;
+    w->ctx = ctx;
+    w->events = events;
+    w->gen = gen;
+    return 0;
+}
+// Change read/write interest of a registered fd.
+int evloop_mod(evloop_t *loop, int fd, int events) {
+    assert(fd >= 0 && fd < loop->watches_cap);
+    evwatch_t *w = &loop->watches[fd];
+    if (w->events == events)
+        return 0;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = to_epoll_events(events);
+    ev.data.u64 = to_epoll_data(fd, w->gen);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+        return -1;
+    w->events = events;
+    return 0;
+}
+// Unregister fd. Should be called before fd is closed.
+int evloop_del(evloop_t *loop, int fd) {
+    if (fd < 0 || fd >= loop->watches_cap)
+        return -1;
+    memset(&loop->watches[fd], 0, sizeof(evwatch_t));
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+// Return ctx pointer registered with fd, or NULL if fd not registered.
+void *evloop_ctx(evloop_t *loop, int fd) {
+    if (fd < 0 || fd >= loop->watches_cap)
+        return NULL;
+    return loop->watches[fd].ctx;
+}
+// Return arena for per-message scratch allocations made by callbacks.
+// Allocations stay valid until the next evloop_run_once() call, so the
+// caller can still use them between iterations.
+arena_t *evloop_arena(evloop_t *loop) {
+    return loop->arena;
+}
+
+// Wait up to timeout_ms (-1 to wait indefinitely) and dispatch ready events.
+// Returns number of events dispatched or -1 for error.
+int evloop_run_once(evloop_t *loop, int timeout_ms) {
+    struct epoll_event evs[EVLOOP_MAXEVENTS];
+
+    // Scratch allocations from the previous batch are done with.
+    arena_reset(loop->arena);
+
+    int n = epoll_wait(loop->epfd, evs, countof(evs), timeout_ms);
+    if (n == -1 && errno == EINTR)
+        return 0;
+    if (n == -1) {
+        print_error("epoll_wait()");
+        return -1;
+    }
+
+    for (int i=0; i < n; i++) {
+        int fd = (int) (uint32_t) evs[i].data.u64;
+        uint32_t gen = evs[i].data.u64 >> 32;
+        // fd may have been unregistered by an earlier callback in this batch,
+        // and possibly reused by a new watch since.
+        if (fd >= loop->watches_cap)
+            continue;
+        evwatch_t *w = &loop->watches[fd];
+        if (w->func == NULL || w->gen != gen)
+            continue;
+        (*w->func)(loop, fd, from_epoll_events(evs[i].events), w->ctx);
+    }
+    return n;
+}
+// Dispatch events until evloop_stop() is called.
+int evloop_run(evloop_t *loop) {
+    loop->running = 1;
+    while (loop->running) {
+        if (evloop_run_once(loop, -1) == -1)
+            return -1;
+    }
+    return 0;
+}
+void evloop_stop(evloop_t *loop) {
+    loop->running = 0;
+}
+
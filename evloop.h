@@ -0,0 +1,47 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+// Event interest / readiness flags
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4   // peer hangup or socket error (always reported)
+
+// Max number of ready events fetched per epoll_wait() call.
+#define EVLOOP_MAXEVENTS 256
+
+typedef struct evloop evloop_t;
+
+// Called when fd becomes ready. events is a combination of EV_* flags.
+// Watches are edge-triggered: the callback must read/write until the
+// socket returns EAGAIN or it will not be notified again.
+typedef void (*evfunc_t)(evloop_t *loop, int fd, int events, void *ctx);
+
+typedef struct {
+    evfunc_t func;
+    void *ctx;
+    int events;
+    uint32_t gen;           // generation of this registration
+} evwatch_t;
+
+struct evloop {
+    int epfd;
+    evwatch_t *watches;     // indexed by fd
+    size_t watches_cap;
+    uint32_t nextgen;       // bumped on every evloop_add()
+    int running;
+    arena_t *arena;         // reset at the start of each evloop_run_once()
+};
+
+evloop_t *evloop_new();
+void evloop_free(evloop_t *loop);
+int evloop_add(evloop_t *loop, int fd, int events, evfunc_t func, void *ctx);
+int evloop_mod(evloop_t *loop, int fd, int events);
+int evloop_del(evloop_t *loop, int fd);
+void *evloop_ctx(evloop_t *loop, int fd);
+arena_t *evloop_arena(evloop_t *loop);
+int evloop_run_once(evloop_t *loop, int timeout_ms);
+int evloop_run(evloop_t *loop);
+void evloop_stop(evloop_t *loop);
+
+#endif
+
@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "clib.h"
+#include "log.h"
+
+#define LOG_RECDATA (LOG_RECSIZE - 24)
+
+typedef struct {
+    uint64_t ts;            // CLOCK_REALTIME nanoseconds
+    const char *fmt;
+    uint8_t level;
+    uint8_t truncated;      // args didn't fit in data
+    uint16_t nargs;
+    uint16_t datalen;
+    char data[LOG_RECDATA]; // packed args: 8 bytes per scalar, u16 len + bytes per string
+} logrec_t;
+
+// Single-producer single-consumer ring owned by one logging thread.
+typedef struct {
+    logrec_t recs[LOG_RINGSIZE];
+    uint32_t head __attribute__((aligned(64)));     // written by producer
+    uint64_t dropped;
+    uint32_t tail __attribute__((aligned(64)));     // written by consumer
+    uint64_t dropped_seen;
+    char name[16];
+} logring_t;
+
+static const char *_levelnames[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static int _log_level = LOG_MIN_LEVEL;
+static int _log_running;
+static int _log_stop;
+static FILE *_logf;
+static pthread_t _log_thread;
+static logring_t *_rings[LOG_MAXTHREADS];
+static int _rings_alloc;
+
+static __thread logring_t *_ring;
+
+static logring_t *get_ring() {
+    if (_ring != NULL)
+        return _ring;
+
+    int i = __atomic_fetch_add(&_rings_alloc, 1, __ATOMIC_RELAXED);
+    if (i >= LOG_MAXTHREADS)
+        return NULL;
+    logring_t *ring = calloc(1, sizeof(logring_t));
+    if (ring == NULL)
+        return NULL;
+    snprintf(ring->name, sizeof(ring->name), "t%d", i);
+    __atomic_store_n(&_rings[i], ring, __ATOMIC_RELEASE);
+    _ring = ring;
+    return ring;
+}
+
+// Name shown for the calling thread's records. Must be called before the
+// thread logs anything.
+void log_set_thread_name(const char *name) {
+    logring_t *ring = get_ring();
+    if (ring != NULL)
+        snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+void log_set_level(int level) {
+    _log_level = level;
+}
+
+// Total records dropped because a ring was full.
+uint64_t log_dropped() {
+    uint64_t n = 0;
+    for (int i=0; i < LOG_MAXTHREADS; i++) {
+        logring_t *ring = __atomic_load_n(&_rings[i], __ATOMIC_ACQUIRE);
+        if (ring != NULL)
+            n += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+// Conversion spec parsed from a format string.
+typedef struct {
+    const char *start;      // '%'
+    const char *end;        // one past conversion char
+    int nstars;             // '*' width/precision args
+    int prec;               // literal precision or -1
+    int precstar;           // precision is '*' (last star arg)
+    char lenmod[3];
+    char conv;
+} logspec_t;
+
+// Parse conversion spec at p (just past '%').
+static const char *parse_spec(const char *p, logspec_t *spec) {
+    spec->start = p-1;
+    spec->nstars = 0;
+    spec->prec = -1;
+    spec->precstar = 0;
+    memset(spec->lenmod, 0, sizeof(spec->lenmod));
+
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+    if (*p == '*') {
+        spec->nstars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9')
+        p++;
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->nstars++;
+            spec->precstar = 1;
+            p++;
+        } else {
+            spec->prec = 0;
+            while (*p >= '0' && *p <= '9')
+                spec->prec = spec->prec*10 + (*p++ - '0');
+        }
+    }
+    int n = 0;
+    while (*p && strchr("hlzjtL", *p) && n < 2)
+        spec->lenmod[n++] = *p++;
+    spec->conv = *p;
+    if (*p)
+        p++;
+    spec->end = p;
+    return p;
+}
+
+static int pack_bytes(logrec_t *rec, const void *p, size_t len) {
+    if (rec->datalen + len > LOG_RECDATA) {
+        rec->truncated = 1;
+        return -1;
+    }
+    memcpy(rec->data + rec->datalen, p, len);
+    rec->datalen += len;
+    return 0;
+}
+static int pack_u64(logrec_t *rec, uint64_t v) {
+    return pack_bytes(rec, &v, sizeof(v));
+}
+
+// Read a signed or unsigned integer arg of the given length modifier.
+static uint64_t va_int(va_list *ap, const char *lenmod, int issigned) {
+    if (strcmp(lenmod, "ll") == 0 || strcmp(lenmod, "j") == 0)
+        return issigned ? (uint64_t) va_arg(*ap, long long) : va_arg(*ap, unsigned long long);
+    if (strcmp(lenmod, "l") == 0)
+        return issigned ? (uint64_t) va_arg(*ap, long) : va_arg(*ap, unsigned long);
+    if (strcmp(lenmod, "z") == 0 || strcmp(lenmod, "t") == 0)
+        return issigned ? (uint64_t) va_arg(*ap, ptrdiff_t) : va_arg(*ap, size_t);
+
+    int v = va_arg(*ap, int);
+    if (issigned) {
+        if (strcmp(lenmod, "hh") == 0)
+            return (uint64_t) (signed char) v;
+        if (strcmp(lenmod, "h") == 0)
+            return (uint64_t) (short) v;
+        return (uint64_t) v;
+    }
+    if (strcmp(lenmod, "hh") == 0)
+        return (unsigned char) v;
+    if (strcmp(lenmod, "h") == 0)
+        return (unsigned short) v;
+    return (unsigned) v;
+}
+
+// Copy the args described by fmt into rec without formatting them.
+static void pack_args(logrec_t *rec, const char *fmt, va_list *ap) {
+    logspec_t spec;
+    const char *p = fmt;
+    int stars[2];
+
+    while ((p = strchr(p, '%')) != NULL) {
+        p++;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        p = parse_spec(p, &spec);
+        for (int i=0; i < spec.nstars; i++)
+            stars[i] = va_arg(*ap, int);
+
+        int z = 0;
+        for (int i=0; i < spec.nstars && z == 0; i++)
+            z = pack_u64(rec, (uint64_t) stars[i]);
+
+        if (spec.conv == 'd' || spec.conv == 'i') {
+            uint64_t v = va_int(ap, spec.lenmod, 1);
+            if (z == 0)
+                z = pack_u64(rec, v);
+        } else if (strchr("uxXoc", spec.conv)) {
+            uint64_t v = va_int(ap, spec.lenmod, 0);
+            if (z == 0)
+                z = pack_u64(rec, v);
+        } else if (spec.conv == 'p') {
+            uint64_t v = (uintptr_t) va_arg(*ap, void *);
+            if (z == 0)
+                z = pack_u64(rec, v);
+        } else if (strchr("feEgG", spec.conv)) {
+            double d = va_arg(*ap, double);
+            if (z == 0)
+                z = pack_bytes(rec, &d, sizeof(d));
+        } else if (spec.conv == 's') {
+            const char *s = va_arg(*ap, const char *);
+            if (s == NULL)
+                s = "(null)";
+            // Precision bounds the string, which needn't be NUL terminated.
+            int maxlen = spec.precstar ? stars[spec.nstars-1] : spec.prec;
+            uint16_t len = maxlen >= 0 ? strnlen(s, maxlen) : strlen(s);
+            if (rec->datalen + sizeof(len) + len > LOG_RECDATA && z == 0) {
+                // Keep what fits of the string.
+                int avail = (int) LOG_RECDATA - rec->datalen - (int) sizeof(len);
+                if (avail > 0) {
+                    len = avail;
+                    pack_bytes(rec, &len, sizeof(len));
+                    pack_bytes(rec, s, len);
+                    rec->nargs++;
+                }
+                rec->truncated = 1;
+                return;
+            }
+            if (z == 0)
+                z = pack_bytes(rec, &len, sizeof(len));
+            if (z == 0)
+                z = pack_bytes(rec, s, len);
+        } else {
+            // Unsupported conversion, args after it can't be located.
+            rec->truncated = 1;
+            return;
+        }
+        if (z != 0)
+            return;
+        rec->nargs++;
+    }
+}
+
+static uint64_t unpack_u64(logrec_t *rec, size_t *pos) {
+    uint64_t v;
+    memcpy(&v, rec->data + *pos, sizeof(v));
+    *pos += sizeof(v);
+    return v;
+}
+
+// Append formatted message of rec to out[*outlen..outcap).
+static void format_args(logrec_t *rec, char *out, size_t *outlen, size_t outcap) {
+    logspec_t spec;
+    const char *p = rec->fmt;
+    size_t pos = 0;
+    int nargs = 0;
+    char specbuf[32];
+    char sbuf[LOG_RECDATA+1];
+
+#define OUT_AVAIL() (*outlen < outcap ? outcap - *outlen : 0)
+#define OUT_ADVANCE(z) do { if ((z) > 0) *outlen += (size_t) (z) < OUT_AVAIL() ? (size_t) (z) : OUT_AVAIL(); } while (0)
+
+    while (*p) {
+        const char *pct = strchr(p, '%');
+        size_t litlen = pct ? (size_t) (pct-p) : strlen(p);
+        if (litlen > 0) {
+            size_t n = litlen < OUT_AVAIL() ? litlen : OUT_AVAIL();
+            memcpy(out + *outlen, p, n);
+            *outlen += n;
+        }
+        if (pct == NULL)
+            break;
+        p = pct+1;
+        if (*p == '%') {
+            if (OUT_AVAIL() > 0)
+                out[(*outlen)++] = '%';
+            p++;
+            continue;
+        }
+        p = parse_spec(p, &spec);
+        if (nargs >= rec->nargs) {
+            if (rec->truncated) {
+                int z = snprintf(out + *outlen, OUT_AVAIL(), "...");
+                OUT_ADVANCE(z);
+            }
+            break;
+        }
+        nargs++;
+
+        // Rebuild spec without length modifier, ints are passed as long long.
+        size_t speclen = 0;
+        for (const char *q=spec.start; q < spec.end-1 && speclen < sizeof(specbuf)-4; q++) {
+            if (!strchr("hlzjtL", *q))
+                specbuf[speclen++] = *q;
+        }
+        if (strchr("diuxXo", spec.conv)) {
+            specbuf[speclen++] = 'l';
+            specbuf[speclen++] = 'l';
+        }
+        specbuf[speclen++] = spec.conv;
+        specbuf[speclen] = 0;
+
+        int stars[2] = {0, 0};
+        for (int i=0; i < spec.nstars; i++)
+            stars[i] = (int) unpack_u64(rec, &pos);
+
+        int z = 0;
+        if (spec.conv == 's') {
+            uint16_t len;
+            memcpy(&len, rec->data + pos, sizeof(len));
+            pos += sizeof(len);
+            memcpy(sbuf, rec->data + pos, len);
+            sbuf[len] = 0;
+            pos += len;
+            if (spec.nstars == 2)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], stars[1], sbuf);
+            else if (spec.nstars == 1)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], sbuf);
+            else
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, sbuf);
+        } else if (strchr("feEgG", spec.conv)) {
+            double d;
+            memcpy(&d, rec->data + pos, sizeof(d));
+            pos += sizeof(d);
+            if (spec.nstars == 2)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], stars[1], d);
+            else if (spec.nstars == 1)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], d);
+            else
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, d);
+        } else if (spec.conv == 'p') {
+            void *v = (void *) (uintptr_t) unpack_u64(rec, &pos);
+            if (spec.nstars == 2)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], stars[1], v);
+            else if (spec.nstars == 1)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], v);
+            else
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, v);
+        } else if (spec.conv == 'c') {
+            int v = (int) unpack_u64(rec, &pos);
+            if (spec.nstars == 1)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], v);
+            else
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, v);
+        } else {
+            long long v = (long long) unpack_u64(rec, &pos);
+            if (spec.nstars == 2)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], stars[1], v);
+            else if (spec.nstars == 1)
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, stars[0], v);
+            else
+                z = snprintf(out + *outlen, OUT_AVAIL(), specbuf, v);
+        }
+        OUT_ADVANCE(z);
+    }
+#undef OUT_AVAIL
+#undef OUT_ADVANCE
+}
+
+// Format rec as a log line into out (NUL terminated, ends with newline).
+// Returns line length.
+static size_t format_rec(logrec_t *rec, const char *name, char *out, size_t outcap) {
+    struct tm tm;
+    time_t secs = rec->ts / 1000000000;
+    localtime_r(&secs, &tm);
+    size_t len = strftime(out, outcap, "%Y-%m-%d %H:%M:%S", &tm);
+    int z = snprintf(out+len, outcap-len, ".%06u %-5s [%s] ",
+                     (unsigned) (rec->ts % 1000000000 / 1000), _levelnames[rec->level], name);
+    len += z;
+    format_args(rec, out, &len, outcap-2);
+    out[len++] = '\n';
+    out[len] = 0;
+    return len;
+}
+
+void log_write(int level, const char *fmt, ...) {
+    if (level < _log_level)
+        return;
+
+    logrec_t tmp;
+    logrec_t *rec = &tmp;
+    logring_t *ring = NULL;
+    uint32_t head = 0;
+
+    if (__atomic_load_n(&_log_running, __ATOMIC_ACQUIRE))
+        ring = get_ring();
+    if (ring != NULL) {
+        head = ring->head;
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - tail >= LOG_RINGSIZE) {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        rec = &ring->recs[head & (LOG_RINGSIZE-1)];
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->ts = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->fmt = fmt;
+    rec->level = level;
+    rec->truncated = 0;
+    rec->nargs = 0;
+    rec->datalen = 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+    pack_args(rec, fmt, &ap);
+    va_end(ap);
+
+    if (ring == NULL) {
+        // Logger not running, write synchronously.
+        char line[1024];
+        size_t len = format_rec(rec, "-", line, sizeof(line));
+        fwrite(line, 1, len, stderr);
+        return;
+    }
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+// Format and write all queued records. Returns number of records written.
+static int drain_rings() {
+    char line[1024];
+    int n = 0;
+
+    for (int i=0; i < LOG_MAXTHREADS; i++) {
+        logring_t *ring = __atomic_load_n(&_rings[i], __ATOMIC_ACQUIRE);
+        if (ring == NULL)
+            continue;
+
+        uint32_t tail = ring->tail;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            size_t len = format_rec(&ring->recs[tail & (LOG_RINGSIZE-1)], ring->name, line, sizeof(line));
+            fwrite(line, 1, len, _logf);
+            tail++;
+            n++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_seen) {
+            fprintf(_logf, "log: %lu records dropped by [%s]\n", dropped - ring->dropped_seen, ring->name);
+            ring->dropped_seen = dropped;
+        }
+    }
+    return n;
+}
+
+static void *log_thread_run(void *arg) {
+    struct timespec idle = {0, 5*1000*1000};
+    while (1) {
+        int stopping = __atomic_load_n(&_log_stop, __ATOMIC_ACQUIRE);
+        if (drain_rings() > 0)
+            continue;
+        fflush(_logf);
+        if (stopping)
+            break;
+        nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+// Start background log writer. Log goes to path, or stdout if path is NULL.
+void log_open(const char *path, int level) {
+    _log_level = level;
+    _logf = stdout;
+    if (path != NULL) {
+        _logf = fopen(path, "a");
+        if (_logf == NULL) {
+            print_error(path);
+            _logf = stdout;
+        }
+    }
+    _log_stop = 0;
+    if (pthread_create(&_log_thread, NULL, log_thread_run, NULL) != 0) {
+        print_error("pthread_create()");
+        return;
+    }
+    __atomic_store_n(&_log_running, 1, __ATOMIC_RELEASE);
+}
+
+// Write out remaining records and stop background log writer.
+// Records logged afterwards are written synchronously to stderr.
+void log_close() {
+    if (!__atomic_load_n(&_log_running, __ATOMIC_ACQUIRE))
+        return;
+    __atomic_store_n(&_log_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&_log_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(_log_thread, NULL);
+    if (_logf != stdout)
+        fclose(_logf);
+    _logf = NULL;
+}
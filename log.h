@@ -0,0 +1,61 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Asynchronous logger.
+//
+// Each thread appends binary records to its own lock-free ring. A record
+// holds the format string pointer and the raw argument values (strings
+// are copied), so the calling thread never formats anything. A
+// background thread started by log_open() drains the rings, formats the
+// records and writes them to the log file. If a ring is full the record
+// is dropped and counted rather than blocking the caller.
+//
+// Before log_open() is called (e.g. in tclient), records are formatted
+// and written to stderr synchronously.
+//
+// Format strings must be string literals. Supported conversions are
+// d i u x X o c p s f e g and %%, with flags, width and precision
+// (including '*') and length modifiers hh h l ll z j t.
+
+#define LOG_DEBUG 0
+#define LOG_INFO  1
+#define LOG_WARN  2
+#define LOG_ERROR 3
+
+// Log calls below LOG_MIN_LEVEL are compiled out.
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_INFO
+#endif
+
+#define LOG_RECSIZE    256     // bytes per record, including header
+#define LOG_RINGSIZE   4096    // records per thread ring (power of 2)
+#define LOG_MAXTHREADS 64
+
+void log_open(const char *path, int level);
+void log_close();
+void log_set_level(int level);
+void log_set_thread_name(const char *name);
+uint64_t log_dropped();
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#if LOG_MIN_LEVEL <= LOG_DEBUG
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) do {} while (0)
+#endif
+#if LOG_MIN_LEVEL <= LOG_INFO
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...) do {} while (0)
+#endif
+#if LOG_MIN_LEVEL <= LOG_WARN
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...) do {} while (0)
+#endif
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+#endif
+
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "lz.h"
+
+// Match finder: positions of recently seen 4 byte sequences, by hash.
+// Per thread, so that workers can compress at the same time.
+#define LZ_HASHBITS 12
+static __thread uint16_t _lzhash[1 << LZ_HASHBITS];
+
+// Token nibble meaning "more in a varint".
+#define LZ_NIBBLE_MAX 15
+
+// Worst case bytes of a sequence besides its literals: token, two 5 byte
+// varints and the offset.
+#define LZ_SEQ_MAX 13
+
+static inline uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASHBITS);
+}
+
+static inline char *put_len(char *p, uint32_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// Add varint at *pp to *len.
+// Returns 0 on success or -1 if truncated or too long.
+static inline int get_len(const uint8_t **pp, const uint8_t *end, uint32_t *len) {
+    const uint8_t *p = *pp;
+    uint32_t n = 0;
+    for (int shift=0; p < end && shift < 28; shift += 7) {
+        uint8_t b = *p++;
+        n |= (uint32_t) (b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *len += n;
+            *pp = p;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Write a sequence of nlit literals at lit and a match of mlen bytes
+// off bytes back (mlen 0 for the last sequence) at *op, advancing it.
+// Returns 0 on success or -1 if it doesn't fit before oend.
+static int put_seq(char **op, char *oend, const char *lit, uint32_t nlit, uint32_t off, uint32_t mlen) {
+    char *p = *op;
+    if (oend - p < (long) nlit + LZ_SEQ_MAX)
+        return -1;
+
+    uint32_t mnib = mlen > 0 ? mlen - LZ_MINMATCH : 0;
+    uint8_t token = (nlit < LZ_NIBBLE_MAX ? nlit : LZ_NIBBLE_MAX) << 4;
+    token |= mnib < LZ_NIBBLE_MAX ? mnib : LZ_NIBBLE_MAX;
+    *p++ = token;
+    if (nlit >= LZ_NIBBLE_MAX)
+        p = put_len(p, nlit - LZ_NIBBLE_MAX);
+    memcpy(p, lit, nlit);
+    p += nlit;
+    if (mlen > 0) {
+        *p++ = off;
+        *p++ = off >> 8;
+        if (mnib >= LZ_NIBBLE_MAX)
+            p = put_len(p, mnib - LZ_NIBBLE_MAX);
+    }
+    *op = p;
+    return 0;
+}
+
+// Compress n bytes at src into dst, which holds cap bytes.
+// Returns compressed length, or 0 if it doesn't fit in cap.
+int lz_compress(const char *src, int n, char *dst, int cap) {
+    assert(n >= 0 && n <= LZ_MAXLEN);
+    memset(_lzhash, 0, sizeof(_lzhash));
+
+    const char *ip = src;
+    const char *end = src + n;
+    const char *anchor = src;   // start of pending literals
+    char *op = dst;
+    char *oend = dst + cap;
+
+    while (end - ip >= LZ_MINMATCH) {
+        uint32_t v = read32(ip);
+        uint32_t h = lz_hash(v);
+        const char *ref = src + _lzhash[h];
+        _lzhash[h] = ip - src;
+        if (ref >= ip || read32(ref) != v) {
+            ip++;
+            continue;
+        }
+
+        const char *m = ip + LZ_MINMATCH;
+        const char *r = ref + LZ_MINMATCH;
+        while (m < end && *m == *r) {
+            m++;
+            r++;
+        }
+        if (put_seq(&op, oend, anchor, ip - anchor, ip - ref, m - ip) == -1)
+            return 0;
+        ip = m;
+        anchor = ip;
+    }
+    if (anchor < end && put_seq(&op, oend, anchor, end - anchor, 0, 0) == -1)
+        return 0;
+    return op - dst;
+}
+
+// Decompress n bytes at src into dst, which holds cap bytes. src may
+// come from the network, so nothing in it is trusted.
+// Returns decompressed length, or -1 for malformed input or if it
+// doesn't fit in cap.
+int lz_decompress(const char *src, int n, char *dst, int cap) {
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *end = ip + n;
+    char *op = dst;
+    char *oend = dst + cap;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        uint32_t nlit = token >> 4;
+        if (nlit == LZ_NIBBLE_MAX && get_len(&ip, end, &nlit) == -1)
+            return -1;
+        if (nlit > end - ip || nlit > oend - op)
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == end)
+            return (token & LZ_NIBBLE_MAX) == 0 ? op - dst : -1;
+
+        if (end - ip < 2)
+            return -1;
+        uint32_t off = ip[0] | ip[1] << 8;
+        ip += 2;
+        uint32_t mlen = token & LZ_NIBBLE_MAX;
+        if (mlen == LZ_NIBBLE_MAX && get_len(&ip, end, &mlen) == -1)
+            return -1;
+        mlen += LZ_MINMATCH;
+        if (off == 0 || off > op - dst || mlen > oend - op)
+            return -1;
+
+        // A match may overlap its own output (a repeating run), in which
+        // case it has to be copied a byte at a time.
+        const char *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+        } else {
+            for (uint32_t i=0; i < mlen; i++)
+                op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return op - dst;
+}
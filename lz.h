@@ -0,0 +1,24 @@
+#ifndef LZ_H
+#define LZ_H
+
+// LZ77 block compression of message bodies, in the spirit of LZ4: fast
+// and byte oriented, trading ratio for speed. Blocks are compressed
+// independently, so any one can be decompressed on its own.
+//
+// A block is a series of sequences, each
+//   [1 byte] token, high 4 bits literal count, low 4 bits match length
+//            minus LZ_MINMATCH; 15 means a varint with the rest follows
+//   [varint] rest of literal count, if any
+//   literal bytes
+//   [2 bytes] match offset back from the end of output, low byte first
+//   [varint] rest of match length, if any
+// The last sequence ends after its literals.
+
+// Blocks hold at most LZ_MAXLEN bytes, so that offsets fit in 2 bytes.
+#define LZ_MAXLEN   65535
+#define LZ_MINMATCH 4
+
+int lz_compress(const char *src, int n, char *dst, int cap);
+int lz_decompress(const char *src, int n, char *dst, int cap);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "clib.h"
+#include "cnet.h"
+#include "log.h"
+#include "metrics.h"
+
+__thread metrics_t *_metrics;
+
+static metrics_t *_allmetrics[METRICS_MAXTHREADS];
+static int _allmetrics_alloc;
+static int _adminfd = -1;
+
+// Register metrics for the calling thread and return them.
+metrics_t *metrics_thread_init() {
+    if (_metrics != NULL)
+        return _metrics;
+
+    metrics_t *m = calloc(1, sizeof(metrics_t));
+    if (m == NULL)
+        panic("metrics_thread_init() out of memory");
+    int i = __atomic_fetch_add(&_allmetrics_alloc, 1, __ATOMIC_RELAXED);
+    if (i < METRICS_MAXTHREADS)
+        __atomic_store_n(&_allmetrics[i], m, __ATOMIC_RELEASE);
+    else
+        log_warn("metrics_thread_init(): too many threads, metrics not exported");
+    _metrics = m;
+    return m;
+}
+
+void metrics_count_msg(int msgno) {
+    if (msgno < 0 || msgno >= METRICS_MAXMSGNO)
+        msgno = METRICS_MAXMSGNO;
+    METRIC_INC(msgs_decoded[msgno]);
+}
+
+static uint64_t load(uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void dump_hist(str_t *out, const char *name, hist_t *h) {
+    char line[512];
+    snprintf(line, sizeof(line),
+             "%s_count %lu\n%s_mean %lu\n%s_p50 %lu\n%s_p90 %lu\n%s_p99 %lu\n%s_p999 %lu\n%s_max %lu\n",
+             name, h->count,
+             name, h->count > 0 ? h->sum / h->count : 0,
+             name, hist_percentile(h, 50),
+             name, hist_percentile(h, 90),
+             name, hist_percentile(h, 99),
+             name, hist_percentile(h, 99.9),
+             name, h->max);
+    str_append(out, line);
+}
+
+// Append metrics of all threads, summed, to out.
+void metrics_dump(str_t *out) {
+    metrics_t *sum = calloc(1, sizeof(metrics_t));
+    char line[512];
+
+    int nthreads = 0;
+    for (int i=0; i < METRICS_MAXTHREADS; i++) {
+        metrics_t *m = __atomic_load_n(&_allmetrics[i], __ATOMIC_ACQUIRE);
+        if (m == NULL)
+            continue;
+        nthreads++;
+        sum->conns_accepted += load(&m->conns_accepted);
+        sum->conns_closed += load(&m->conns_closed);
+        sum->bytes_in += load(&m->bytes_in);
+        sum->bytes_out += load(&m->bytes_out);
+        sum->resyncs += load(&m->resyncs);
+        sum->oversized += load(&m->oversized);
+        sum->msgs_invalid += load(&m->msgs_invalid);
+        sum->crc_errors += load(&m->crc_errors);
+        sum->replayed += load(&m->replayed);
+        for (int j=0; j <= METRICS_MAXMSGNO; j++)
+            sum->msgs_decoded[j] += load(&m->msgs_decoded[j]);
+        hist_merge(&sum->decode_ns, &m->decode_ns);
+        hist_merge(&sum->queue_ns, &m->queue_ns);
+    }
+
+    snprintf(line, sizeof(line),
+             "threads %d\nconns_accepted %lu\nconns_closed %lu\nconns_open %lu\n"
+             "bytes_in %lu\nbytes_out %lu\nresyncs %lu\noversized %lu\nmsgs_invalid %lu\ncrc_errors %lu\n"
+             "replayed %lu\n",
+             nthreads, sum->conns_accepted, sum->conns_closed, sum->conns_accepted - sum->conns_closed,
+             sum->bytes_in, sum->bytes_out, sum->resyncs, sum->oversized, sum->msgs_invalid, sum->crc_errors,
+             sum->replayed);
+    str_append(out, line);
+    for (int j=0; j < METRICS_MAXMSGNO; j++) {
+        if (sum->msgs_decoded[j] == 0)
+            continue;
+        snprintf(line, sizeof(line), "msgs_decoded{msgno=\"%d\"} %lu\n", j, sum->msgs_decoded[j]);
+        str_append(out, line);
+    }
+    if (sum->msgs_decoded[METRICS_MAXMSGNO] > 0) {
+        snprintf(line, sizeof(line), "msgs_decoded{msgno=\"other\"} %lu\n", sum->msgs_decoded[METRICS_MAXMSGNO]);
+        str_append(out, line);
+    }
+    dump_hist(out, "decode_ns", &sum->decode_ns);
+    dump_hist(out, "queue_ns", &sum->queue_ns);
+    snprintf(line, sizeof(line), "log_dropped %lu\n", log_dropped());
+    str_append(out, line);
+
+    free(sum);
+}
+
+// Admin thread: write a metrics dump to each client that connects.
+static void *admin_run(void *arg) {
+    str_t *out = str_new(0);
+    while (1) {
+        int fd = accept(_adminfd, NULL, NULL);
+        if (fd == -1 && errno == EINTR)
+            continue;
+        if (fd == -1) {
+            print_error("accept()");
+            break;
+        }
+        str_assign(out, "");
+        metrics_dump(out);
+
+        size_t nsent = 0;
+        while (nsent < out->len) {
+            ssize_t z = send(fd, out->s + nsent, out->len - nsent, MSG_NOSIGNAL);
+            if (z == -1 && errno == EINTR)
+                continue;
+            if (z <= 0)
+                break;
+            nsent += z;
+        }
+        close(fd);
+    }
+    str_free(out);
+    return NULL;
+}
+
+// Start admin thread serving metrics on Unix domain socket at path.
+// Returns 0 on success or -1 for error.
+int metrics_serve(const char *path) {
+    _adminfd = open_unix_listen_sock(path, 16);
+    if (_adminfd == -1)
+        return -1;
+
+    pthread_t thread;
+    int z = pthread_create(&thread, NULL, admin_run, NULL);
+    if (z != 0) {
+        close(_adminfd);
+        _adminfd = -1;
+        errno = z;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "clib.h"
+
+// Server metrics.
+//
+// Each thread updates its own metrics_t without atomic read-modify-write
+// or locks (see METRIC_ADD). The admin thread started by metrics_serve()
+// sums all threads' metrics when a client connects to its Unix domain
+// socket and writes them as text, one "name value" per line.
+
+// Decoded message counts are kept per msgno below this, the rest are
+// counted together.
+#define METRICS_MAXMSGNO 256
+
+#define METRICS_MAXTHREADS 64
+
+typedef struct {
+    uint64_t conns_accepted;
+    uint64_t conns_closed;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t resyncs;               // RECV_SIG skipped bytes to find a signature, or lost a compact stream's boundaries
+    uint64_t oversized;             // messages rejected for bodylen or malformed header
+    uint64_t msgs_invalid;
+    uint64_t crc_errors;            // messages failing their checksum
+    uint64_t replayed;              // history entries queued to clients asking for them
+    uint64_t msgs_decoded[METRICS_MAXMSGNO+1];
+    hist_t decode_ns;               // time to decode one message
+    hist_t queue_ns;                // time a buffer spends in an output queue
+} metrics_t;
+
+extern __thread metrics_t *_metrics;
+
+// Single writer per metrics_t, so a plain add published with an atomic
+// store is enough for readers never to see a torn value.
+#define METRIC_ADD(field, n) __atomic_store_n(&_metrics->field, _metrics->field + (n), __ATOMIC_RELAXED)
+#define METRIC_INC(field)    METRIC_ADD(field, 1)
+
+metrics_t *metrics_thread_init();
+void metrics_count_msg(int msgno);
+void metrics_dump(str_t *out);
+int metrics_serve(const char *path);
+
+#endif
+
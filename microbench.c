@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "clib.h"
+#include "msg.h"
+#include "scan.h"
+#include "lz.h"
+
+// Microbenchmarks for clib containers, scanners and msg.c pack/unpack.
+//
+// Each benchmark runs for at least BENCH_MINNS, doubling its iteration
+// count until it does, and prints one tab-separated line:
+//   name  size  iters  ns_per_op  allocs_per_op
+// so that runs can be saved and compared between commits.
+//
+// Allocations are counted by wrapping malloc/calloc/realloc at link time
+// (see the microbench target in the Makefile).
+//
+// Compression ratios, the bandwidth the CPU time of the lz benchmarks
+// buys, are printed as comment lines:
+//   # lz_ratio  size  compressed_size  ratio
+
+#define BENCH_MINNS 200000000ULL
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+uint64_t _nallocs;
+
+void *__wrap_malloc(size_t size) {
+    _nallocs++;
+    return __real_malloc(size);
+}
+void *__wrap_calloc(size_t n, size_t size) {
+    _nallocs++;
+    return __real_calloc(n, size);
+}
+void *__wrap_realloc(void *p, size_t size) {
+    _nallocs++;
+    return __real_realloc(p, size);
+}
+
+// Keeps results alive so the compiler can't drop the benchmarked work.
+volatile uint64_t _sink;
+
+typedef void (*benchfunc_t)(size_t size, uint64_t iters);
+
+static void run_bench(const char *name, benchfunc_t func, size_t size) {
+    uint64_t iters = 1;
+    while (1) {
+        uint64_t nallocs0 = _nallocs;
+        uint64_t t0 = clock_ns();
+        func(size, iters);
+        uint64_t elapsed = clock_ns() - t0;
+        uint64_t nallocs = _nallocs - nallocs0;
+
+        if (elapsed >= BENCH_MINNS || iters >= (1ULL << 40)) {
+            printf("%s\t%zu\t%lu\t%.2f\t%.4f\n", name, size, iters,
+                   (double) elapsed / iters, (double) nallocs / iters);
+            fflush(stdout);
+            return;
+        }
+        iters *= 2;
+    }
+}
+
+// Run benchmark once per scanner implementation the CPU supports, as
+// name_{scalar,sse2,avx2}.
+static void run_bench_impls(const char *name, benchfunc_t func, size_t *sizes, int nsizes) {
+    int best = scan_impl();
+    int impls[] = {SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2};
+    for (int j=0; j < countof(impls); j++) {
+        if (scan_set_impl(impls[j]) != 0)
+            continue;
+        char implname[64];
+        snprintf(implname, sizeof(implname), "%s_%s", name, scan_impl_name(impls[j]));
+        for (int i=0; i < nsizes; i++)
+            run_bench(implname, func, sizes[i]);
+    }
+    scan_set_impl(best);
+}
+
+static char *make_bytes(size_t size) {
+    char *p = malloc(size + 1);
+    for (size_t i=0; i < size; i++)
+        p[i] = 'a' + i % 26;
+    p[size] = 0;
+    return p;
+}
+
+// Append size bytes per op, clearing the buffer every 1MB.
+static void bench_buf_append(size_t size, uint64_t iters) {
+    char *bs = make_bytes(size);
+    buf_t *buf = buf_new(0);
+    for (uint64_t i=0; i < iters; i++) {
+        if (buf->len + size > SIZE_MB)
+            buf_clear(buf);
+        buf_append(buf, bs, size);
+    }
+    _sink += buf->len;
+    buf_free(buf);
+    free(bs);
+}
+
+// Find a signature at the end of size bytes.
+static void bench_buf_find(size_t size, uint64_t iters) {
+    char *bs = make_bytes(size);
+    memcpy(bs + size - MSG_SIG_LEN, MSG_SIG, MSG_SIG_LEN);
+    buf_t *buf = buf_new(size);
+    buf_append(buf, bs, size);
+    for (uint64_t i=0; i < iters; i++)
+        _sink += buf_find(buf, MSG_SIG, MSG_SIG_LEN);
+    buf_free(buf);
+    free(bs);
+}
+
+// Random bytes, as on a desynced or hostile connection.
+static char *make_junk(size_t size) {
+    char *p = malloc(size);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t i=0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        p[i] = x;
+    }
+    return p;
+}
+
+// scan_find4() for a signature at the end of size bytes of junk, with
+// the scanner currently selected by scan_set_impl().
+static void bench_sig_scan(size_t size, uint64_t iters) {
+    assert(size >= MSG_SIG_LEN);
+    char *bs = make_junk(size);
+    memcpy(bs + size - MSG_SIG_LEN, MSG_SIG, MSG_SIG_LEN);
+    for (uint64_t i=0; i < iters; i++)
+        _sink += scan_find4(bs, size, MSG_SIG);
+    free(bs);
+}
+
+// Header-heavy httplike messages filling size bytes.
+static char *make_headers(size_t size) {
+    char *p = malloc(size);
+    str_t *msg = str_new(0);
+    str_assign(msg, "TH/0.1 send message\n");
+    for (int i=0; i < 20; i++) {
+        char line[64];
+        snprintf(line, sizeof(line), "x-header-%d: value of header %d\n", i, i);
+        str_append(msg, line);
+    }
+    str_append(msg, "body-length: 0\n\n");
+    for (size_t i=0; i < size; i++)
+        p[i] = msg->s[i % msg->len];
+    str_free(msg);
+    return p;
+}
+
+// scan_lines() over size bytes of headers, with the scanner currently
+// selected by scan_set_impl().
+static void bench_scan_lines(size_t size, uint64_t iters) {
+    char *bs = make_headers(size);
+    linespan_t lines[64];
+    for (uint64_t i=0; i < iters; i++) {
+        size_t off = 0;
+        while (1) {
+            size_t n = scan_lines(bs + off, size - off, lines, countof(lines));
+            if (n == 0)
+                break;
+            _sink += lines[n-1].colon;
+            off += lines[n-1].off + lines[n-1].len + 1;
+        }
+    }
+    free(bs);
+}
+
+// Parse a message of size headers into a hdrtbl_t, then look each one up.
+static void bench_hdrtbl(size_t size, uint64_t iters) {
+    str_t *msg = str_new(0);
+    for (int i=0; i < size; i++) {
+        char line[64];
+        snprintf(line, sizeof(line), "X-Header-%d: value of header %d\n", i, i);
+        str_append(msg, line);
+    }
+    linespan_t lines[HDRTBL_MAX];
+    size_t nlines = scan_lines(msg->s, msg->len, lines, countof(lines));
+    hdrtbl_t *t = malloc(sizeof(hdrtbl_t));
+    for (uint64_t i=0; i < iters; i++) {
+        hdrtbl_init(t);
+        for (int j=0; j < nlines; j++) {
+            char *line = msg->s + lines[j].off;
+            int colon = lines[j].colon;
+            hdrtbl_set(t, line, colon, line + colon + 2, lines[j].len - colon - 2);
+        }
+        for (int j=0; j < nlines; j++)
+            _sink += hdrtbl_get(t, msg->s + lines[j].off, lines[j].colon)->vlen;
+        hdrtbl_fini(t);
+    }
+    free(t);
+    str_free(msg);
+}
+
+// Consume size bytes per op from the front of a 64K buffer, refilling it
+// when empty.
+static void bench_buf_stripleft(size_t size, uint64_t iters) {
+    size_t fill = SIZE_MEDIUM * 2 / size * size;
+    char *bs = make_bytes(fill);
+    buf_t *buf = buf_new(fill);
+    for (uint64_t i=0; i < iters; i++) {
+        if (buf_datalen(buf) == 0)
+            buf_append(buf, bs, fill);
+        buf_stripleft(buf, size);
+    }
+    _sink += buf->cur;
+    buf_free(buf);
+    free(bs);
+}
+
+// Assign alternating strings of length size.
+static void bench_str_assign(size_t size, uint64_t iters) {
+    char *s1 = make_bytes(size);
+    char *s2 = make_bytes(size);
+    s2[0] = 'z';
+    str_t *str = str_new(0);
+    for (uint64_t i=0; i < iters; i++)
+        str_assign(str, (i & 1) ? s1 : s2);
+    _sink += str->len;
+    str_free(str);
+    free(s1);
+    free(s2);
+}
+
+// Append a string of length size, resetting every 1MB.
+static void bench_str_append(size_t size, uint64_t iters) {
+    char *s = make_bytes(size);
+    str_t *str = str_new(0);
+    for (uint64_t i=0; i < iters; i++) {
+        if (str->len + size > SIZE_MB)
+            str_assign(str, "");
+        str_append(str, s);
+    }
+    _sink += str->len;
+    str_free(str);
+    free(s);
+}
+
+// With size items in the array, add one at the end and delete the first.
+static void bench_array_add_del(size_t size, uint64_t iters) {
+    array_t *a = array_new(0, NULL);
+    for (size_t i=0; i < size; i++)
+        array_add(a, (void *) (i+1));
+    for (uint64_t i=0; i < iters; i++) {
+        array_add(a, (void *) (i+1));
+        array_del(a, 0);
+    }
+    _sink += a->len;
+    array_free(a);
+}
+
+static void fill_textmsg(TextMsg *tm, size_t textlen) {
+    memset(tm, 0, sizeof(TextMsg));
+    tm->msgno = TEXTMSG_NO;
+    strcpy(tm->alias, "bench");
+    if (textlen > TEXTMSG_TEXT_LEN)
+        textlen = TEXTMSG_TEXT_LEN;
+    memset(tm->text, 'x', textlen);
+}
+
+// pack_msg() then unpack_msg_bytes() a TextMsg with size bytes of text.
+static void bench_pack_unpack(size_t size, uint64_t iters) {
+    TextMsg tm;
+    fill_textmsg(&tm, size);
+    for (uint64_t i=0; i < iters; i++) {
+        char *bs = pack_msg(&tm);
+        TextMsg *tm2 = unpack_msg_bytes(bs);
+        _sink += tm2->text[0];
+        free_msg(tm2);
+        free(bs);
+    }
+}
+
+// pack_msg_buf() then view_msg_bytes() (zero-copy) a TextMsg with size
+// bytes of text.
+static void bench_pack_view(size_t size, uint64_t iters) {
+    TextMsg tm;
+    fill_textmsg(&tm, size);
+    buf_t *buf = buf_new(0);
+    for (uint64_t i=0; i < iters; i++) {
+        buf_clear(buf);
+        pack_msg_buf(&tm, buf);
+        MsgView mv;
+        TextMsgView tv;
+        view_msg_bytes(buf_data(buf), buf_datalen(buf), &mv);
+        view_textmsg(&mv, &tv);
+        _sink += tv.text_len;
+    }
+    buf_free(buf);
+}
+
+// As bench_pack_view() but with fixed size (protocol 0.9) bodies.
+static void bench_pack_view_fixed(size_t size, uint64_t iters) {
+    TextMsg tm;
+    fill_textmsg(&tm, size);
+    buf_t *buf = buf_new(0);
+    for (uint64_t i=0; i < iters; i++) {
+        buf_clear(buf);
+        pack_msg_buf_ver(&tm, MSGVER_FIXED, buf);
+        MsgView mv;
+        TextMsgView tv;
+        view_msg_bytes(buf_data(buf), buf_datalen(buf), &mv);
+        view_textmsg(&mv, &tv);
+        _sink += tv.text_len;
+    }
+    buf_free(buf);
+}
+
+static void bench_pack_view_compact(size_t size, uint64_t iters) {
+    TextMsg tm;
+    fill_textmsg(&tm, size);
+    buf_t *buf = buf_new(0);
+    for (uint64_t i=0; i < iters; i++) {
+        buf_clear(buf);
+        pack_msg_buf_ver(&tm, MSGVER_COMPACT, buf);
+        MsgView mv;
+        TextMsgView tv;
+        view_msg_bytes(buf_data(buf), buf_datalen(buf), &mv);
+        view_textmsg(&mv, &tv);
+        _sink += tv.text_len;
+    }
+    buf_free(buf);
+}
+
+// Chat-like text: words from a small vocabulary with numbers mixed in,
+// as in a batch of TextMsgs.
+static char *make_chat(size_t size) {
+    static const char *words[] = {
+        "the", "a", "to", "and", "you", "it", "is", "that", "what", "for",
+        "on", "have", "this", "with", "just", "not", "ok", "lol", "yeah",
+        "meeting", "tomorrow", "server", "message", "thanks", "later",
+        "deploy", "build", "failed", "again", "check", "logs", "guest",
+    };
+    char *p = malloc(size);
+    uint64_t x = 88172645463325252ULL;
+    size_t i = 0;
+    while (i < size) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        char word[32];
+        int n = (x >> 40) % 8 == 0 ? snprintf(word, sizeof(word), "%lu ", x % 100000) :
+                                      snprintf(word, sizeof(word), "%s ", words[x % countof(words)]);
+        for (int j=0; j < n && i < size; j++)
+            p[i++] = word[j];
+    }
+    return p;
+}
+
+// lz_compress() size bytes of chat text.
+static void bench_lz_compress(size_t size, uint64_t iters) {
+    char *bs = make_chat(size);
+    char *out = malloc(size);
+    for (uint64_t i=0; i < iters; i++)
+        _sink += lz_compress(bs, size, out, size);
+    free(out);
+    free(bs);
+}
+
+// lz_decompress() size bytes of chat text.
+static void bench_lz_decompress(size_t size, uint64_t iters) {
+    char *bs = make_chat(size);
+    char *lz = malloc(size);
+    int n = lz_compress(bs, size, lz, size);
+    assert(n > 0);
+    for (uint64_t i=0; i < iters; i++)
+        _sink += lz_decompress(lz, n, bs, size);
+    free(lz);
+    free(bs);
+}
+
+static void print_lz_ratio(size_t size) {
+    char *bs = make_chat(size);
+    char *lz = malloc(size);
+    int n = lz_compress(bs, size, lz, size);
+    printf("# lz_ratio\t%zu\t%d\t%.2f\n", size, n, n > 0 ? (double) size / n : 0);
+    free(lz);
+    free(bs);
+}
+
+// Pack size short messages into one batch frame and view them all.
+static void bench_batch_pack_view(size_t size, uint64_t iters) {
+    TextMsg tm;
+    fill_textmsg(&tm, 8);
+    buf_t *buf = buf_new(0);
+    for (uint64_t i=0; i < iters; i++) {
+        buf_clear(buf);
+        MsgBatch b;
+        batch_init(&b, MSGVER_VARLEN, 0);
+        for (size_t j=0; j < size; j++)
+            batch_add(&b, buf, &tm);
+        batch_end(&b, buf);
+
+        MsgView mv, sub;
+        TextMsgView tv;
+        int off = 0;
+        view_msg_bytes(buf_data(buf), buf_datalen(buf), &mv);
+        while (view_batch_next(&mv, &off, &sub) == 1) {
+            view_textmsg(&sub, &tv);
+            _sink += tv.text_len;
+        }
+    }
+    buf_free(buf);
+}
+
+// As bench_batch_pack_view() with chat text, compressed by batch_end()
+// and inflated before viewing.
+static void bench_batch_pack_view_lz(size_t size, uint64_t iters) {
+    TextMsg tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.msgno = TEXTMSG_NO;
+    strcpy(tm.alias, "bench");
+    char *text = make_chat(64);
+    memcpy(tm.text, text, 64);
+    free(text);
+    buf_t *buf = buf_new(0);
+    buf_t *inflatebuf = buf_new(0);
+    for (uint64_t i=0; i < iters; i++) {
+        buf_clear(buf);
+        MsgBatch b;
+        batch_init(&b, MSGVER_COMPACT, MSG_FLAG_LZ);
+        for (size_t j=0; j < size; j++)
+            batch_add(&b, buf, &tm);
+        batch_end(&b, buf);
+
+        MsgView mv, plain, sub;
+        TextMsgView tv;
+        int off = 0;
+        buf_clear(inflatebuf);
+        view_msg_bytes(buf_data(buf), buf_datalen(buf), &mv);
+        msg_inflate(&mv, inflatebuf, &plain);
+        while (view_batch_next(&plain, &off, &sub) == 1) {
+            view_textmsg(&sub, &tv);
+            _sink += tv.text_len;
+        }
+    }
+    buf_free(inflatebuf);
+    buf_free(buf);
+}
+
+int main(int argc, char *argv[]) {
+    size_t bytesizes[] = {8, 64, 512, 4096};
+    size_t findsizes[] = {64, 1024, 16384, 262144};
+    size_t linesizes[] = {4096, 65536};
+    size_t hdrsizes[] = {4, 20};
+    size_t arraysizes[] = {16, 256, 4096};
+    size_t textsizes[] = {8, 64, 255};
+    size_t batchsizes[] = {1, 8, 64};
+    size_t lzsizes[] = {256, 1024, 4096, 10000};
+
+    printf("# name\tsize\titers\tns_per_op\tallocs_per_op\n");
+    for (int i=0; i < countof(bytesizes); i++)
+        run_bench("buf_append", bench_buf_append, bytesizes[i]);
+    for (int i=0; i < countof(findsizes); i++)
+        run_bench("buf_find", bench_buf_find, findsizes[i]);
+    run_bench_impls("sig_scan", bench_sig_scan, findsizes, countof(findsizes));
+    run_bench_impls("scan_lines", bench_scan_lines, linesizes, countof(linesizes));
+    for (int i=0; i < countof(hdrsizes); i++)
+        run_bench("hdrtbl", bench_hdrtbl, hdrsizes[i]);
+    for (int i=0; i < countof(bytesizes); i++)
+        run_bench("buf_stripleft", bench_buf_stripleft, bytesizes[i]);
+    for (int i=0; i < countof(bytesizes); i++)
+        run_bench("str_assign", bench_str_assign, bytesizes[i]);
+    for (int i=0; i < countof(bytesizes); i++)
+        run_bench("str_append", bench_str_append, bytesizes[i]);
+    for (int i=0; i < countof(arraysizes); i++)
+        run_bench("array_add_del", bench_array_add_del, arraysizes[i]);
+    for (int i=0; i < countof(textsizes); i++)
+        run_bench("pack_unpack", bench_pack_unpack, textsizes[i]);
+    for (int i=0; i < countof(textsizes); i++)
+        run_bench("pack_view", bench_pack_view, textsizes[i]);
+    for (int i=0; i < countof(textsizes); i++)
+        run_bench("pack_view_fixed", bench_pack_view_fixed, textsizes[i]);
+    for (int i=0; i < countof(textsizes); i++)
+        run_bench("pack_view_compact", bench_pack_view_compact, textsizes[i]);
+    for (int i=0; i < countof(batchsizes); i++)
+        run_bench("batch_pack_view", bench_batch_pack_view, batchsizes[i]);
+    for (int i=0; i < countof(batchsizes); i++)
+        run_bench("batch_pack_view_lz", bench_batch_pack_view_lz, batchsizes[i]);
+    for (int i=0; i < countof(lzsizes); i++)
+        run_bench("lz_compress", bench_lz_compress, lzsizes[i]);
+    for (int i=0; i < countof(lzsizes); i++)
+        run_bench("lz_decompress", bench_lz_decompress, lzsizes[i]);
+    for (int i=0; i < countof(lzsizes); i++)
+        print_lz_ratio(lzsizes[i]);
+    return 0;
+}
@@ -5,27 +5,42 @@
 #include <assert.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include "clib.h"
+#include "log.h"
 #include "msg.h"
+#include "crc32c.h"
+#include "lz.h"
 
-short _msgtbl[] = {
-    TEXTMSG_NO, TEXTMSG_LEN,
-    0
-};
+// Message type descriptor, one per MSG_TYPES entry.
+// Functions taking void *v take the type's TView.
+typedef struct {
+    short msgno;
+    const char *name;
+    short bodylen;          // MSGVER_FIXED body length
+    size_t structsize;
+    int (*view)(MsgView *mv, void *v);
+    void (*viewstruct)(void *msg, void *v);
+    int (*varbodylen)(void *v);
+    void (*encode)(char *body, int ver, void *v);
+    void *(*decode)(void *v);
+} msgdesc_t;
 
-static short lookup_bodylen(short msgno) {
-    short *p = _msgtbl;
-    while (*p != 0) {
-        if (*p == msgno)
-            return *(p+1);
-        p += 2;
-    }
-    return -1;
-}
+// Slab pool of message structs for each msgno, created on first use.
+// Pools are per thread, so a message must be freed by the thread that
+// allocated it.
+__thread pool_t *_msgpools[MSGNO_MAX];
 
-static int msgno_is_valid(short msgno) {
-    if (lookup_bodylen(msgno) >= 0)
-        return 1;
-    return 0;
+static const msgdesc_t *_msgdescs[MSGNO_MAX];
+
+// Scratch for compressing bodies: the body before and after.
+static __thread char _lzraw[MSG_MAX_BODYLEN];
+static __thread char _lzbody[MSG_MAX_BODYLEN];
+
+// Return descriptor of msgno or NULL if not a valid msgno.
+static inline const msgdesc_t *msg_desc(short msgno) {
+    if (msgno < 0 || msgno >= MSGNO_MAX)
+        return NULL;
+    return _msgdescs[msgno];
 }
 
 // Copy len bytes from src to dst, and null-terminate dst.
@@ -37,73 +52,746 @@ static void assign_sz(char *dst, char *src, size_t len) {
 
 // Copies up to len sz chars to dst, padding dst with zeroes to fill len.
 static void copystr_padzero(char *dst, char *sz, size_t len) {
-    strncpy(dst, sz, len);
+    size_t sz_len = strnlen(sz, len);
+    memcpy(dst, sz, sz_len);
+    memset(dst + sz_len, 0, len - sz_len);
+}
+
+// Copies src_len bytes to dst, padding dst with zeroes to fill len.
+static void copybytes_padzero(char *dst, size_t len, char *src, size_t src_len) {
+    memcpy(dst, src, src_len);
+    memset(dst + src_len, 0, len - src_len);
+}
+
+// Number of bytes in varint encoding of v.
+static inline int varint_len(uint32_t v) {
+    int n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+// Write v as a varint (7 bits per byte, low bits first) at p.
+// Returns pointer past it.
+static inline char *varint_put(char *p, uint32_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// Write v (below 1<<14) as a varint of exactly 2 bytes at p, so that it
+// can be filled in after the bytes following it.
+static inline void varint_put2(char *p, uint32_t v) {
+    p[0] = (v & 0x7f) | 0x80;
+    p[1] = v >> 7;
+}
+
+static inline void put_le32(char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+static inline uint32_t get_le32(char *p) {
+    uint8_t *b = (uint8_t *) p;
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t) b[3] << 24;
+}
+
+// Read varint at *pp, not going past end, and advance *pp past it.
+// Returns 0 on success or -1 if truncated or too long.
+static inline int varint_get(char **pp, char *end, uint32_t *v) {
+    char *p = *pp;
+    uint32_t n = 0;
+    for (int shift=0; p < end && shift < 32; shift += 7) {
+        uint8_t b = *p++;
+        n |= (uint32_t) (b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *v = n;
+            *pp = p;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Read a varint length prefixed field of at most maxlen bytes at *pp.
+// Returns 0 on success or -1 for malformed field.
+static inline int get_varfield(char **pp, char *end, size_t maxlen, char **field, size_t *field_len) {
+    uint32_t n;
+    if (varint_get(pp, end, &n) == -1)
+        return -1;
+    if (n > maxlen || n > end - *pp)
+        return -1;
+    *field = *pp;
+    *field_len = n;
+    *pp += n;
+    return 0;
+}
+
+// Return 1 if msgno is a message type, batch or hello, else 0.
+int msg_known(short msgno) {
+    return msg_desc(msgno) != NULL || msgno == MSGNO_BATCH || msgno == MSGNO_HELLO;
+}
+
+// Return slab pool for msgno structs or NULL if msgno not valid.
+pool_t *msg_pool(short msgno) {
+    const msgdesc_t *desc = msg_desc(msgno);
+    if (desc == NULL)
+        return NULL;
+    if (_msgpools[msgno] == NULL)
+        _msgpools[msgno] = pool_new(desc->name, desc->structsize, 0);
+    return _msgpools[msgno];
+}
+
+// Allocate message struct for msgno from its pool. Free with free_msg().
+void *alloc_msg(short msgno) {
+    pool_t *pool = msg_pool(msgno);
+    if (pool == NULL)
+        return NULL;
+    BaseMsg *msg = pool_alloc(pool);
+    msg->msgno = msgno;
+    return msg;
 }
 
 void free_msg(void *msg) {
-    free(msg);
+    if (msg == NULL)
+        return;
+    pool_t *pool = msg_pool(MSGNO(msg));
+    assert(pool != NULL);
+    pool_release(pool, msg);
 }
 
 void unpack_msg_header(char *bs, MsgHeader *mh) {
     char sver[MSG_VER_LEN+1];
 
-    assign_sz(sver, MSG_OFFSET_VER(bs), MSG_VER_LEN);
+    assign_sz(sver, MSG_WIRE(bs)->ver, MSG_VER_LEN);
     mh->ver = atof(sver);
-    assign_sz(mh->agent, MSG_OFFSET_AGENT(bs), MSG_AGENT_LEN);
-    mh->msgno = ntohs(*MSG_OFFSET_MSGNO(bs));
-    mh->bodylen = ntohs(*MSG_OFFSET_BODYLEN(bs));
+    assign_sz(mh->agent, MSG_WIRE(bs)->agent, MSG_AGENT_LEN);
+    mh->msgno = ntohs(MSG_WIRE(bs)->msgno);
+    mh->bodylen = ntohs(MSG_WIRE(bs)->bodylen);
+}
+
+// Per-type view, encode and decode functions, unrolled over each type's
+// fields, and the descriptor pointing to them.
+#define MSG_FIELD_VIEWFIXED(name, LEN, len) \
+    v->name = w->name; \
+    v->name##_len = strnlen(w->name, len);
+#define MSG_FIELD_VIEWVAR(name, LEN, len) \
+    if (get_varfield(&p, end, len, &v->name, &v->name##_len) == -1) \
+        return -1;
+#define MSG_FIELD_VIEWSTRUCT(name, LEN, len) \
+    v->name = m->name; \
+    v->name##_len = strnlen(m->name, len);
+#define MSG_FIELD_VARBODYLEN(name, LEN, len) \
+    + varint_len(v->name##_len) + v->name##_len
+#define MSG_FIELD_ENCODEFIXED(name, LEN, len) \
+    copybytes_padzero(w->name, len, v->name, v->name##_len);
+#define MSG_FIELD_ENCODEVAR(name, LEN, len) \
+    p = varint_put(p, v->name##_len); \
+    memcpy(p, v->name, v->name##_len); \
+    p += v->name##_len;
+#define MSG_FIELD_DECODE(name, LEN, len) \
+    assign_sz(m->name, v->name, v->name##_len);
+
+#define MSG_DEFINE(T, t, NAME, no, FIELDS) \
+    _Static_assert(no > 0 && no < MSGNO_MAX, #T " msgno out of range"); \
+    _Static_assert(sizeof(T##Wire) == NAME##_LEN, #T " wire layout not packed"); \
+    int view_##t(MsgView *mv, T##View *v) { \
+        if (mv->msgno != no) \
+            return -1; \
+        if (mv->ver == MSGVER_FIXED) { \
+            T##Wire *w = (T##Wire *) mv->body; \
+            FIELDS(MSG_FIELD_VIEWFIXED) \
+            return 0; \
+        } \
+        char *p = mv->body; \
+        char *end = mv->body + mv->bodylen; \
+        FIELDS(MSG_FIELD_VIEWVAR) \
+        return p == end ? 0 : -1; \
+    } \
+    static int viewany_##t(MsgView *mv, void *v) { \
+        return view_##t(mv, v); \
+    } \
+    static void viewstruct_##t(void *msg, void *pv) { \
+        T *m = msg; \
+        T##View *v = pv; \
+        FIELDS(MSG_FIELD_VIEWSTRUCT) \
+    } \
+    static int varbodylen_##t(void *pv) { \
+        T##View *v = pv; \
+        return 0 FIELDS(MSG_FIELD_VARBODYLEN); \
+    } \
+    static void encode_##t(char *body, int ver, void *pv) { \
+        T##View *v = pv; \
+        if (ver == MSGVER_FIXED) { \
+            T##Wire *w = (T##Wire *) body; \
+            FIELDS(MSG_FIELD_ENCODEFIXED) \
+            return; \
+        } \
+        char *p = body; \
+        FIELDS(MSG_FIELD_ENCODEVAR) \
+    } \
+    static void *decode_##t(void *pv) { \
+        T##View *v = pv; \
+        T *m = alloc_msg(no); \
+        FIELDS(MSG_FIELD_DECODE) \
+        return m; \
+    } \
+    static const msgdesc_t _msgdesc_##t = { \
+        no, #T, NAME##_LEN, sizeof(T), \
+        viewany_##t, viewstruct_##t, varbodylen_##t, encode_##t, decode_##t \
+    };
+
+MSG_TYPES(MSG_DEFINE)
+
+// Room for a view of any message type.
+#define MSG_VIEW_MEMBER(T, t, NAME, no, FIELDS) T##View t;
+typedef union {
+    MSG_TYPES(MSG_VIEW_MEMBER)
+} AnyMsgView;
+
+static const char *_msgver_strs[MSGVER_COUNT] = {"0.9", "1.0", "2.0"};
+
+_Static_assert(MSG_MAX_BODYLEN < 1<<14, "batch bodylen must fit varint_put2()");
+
+static inline int is_compact(char *bs) {
+    return ((uint8_t) bs[0] & MSG_MAGIC_MASK) == MSG_MAGIC;
+}
+
+// Return MSGVER_* of message at bs (header must be available).
+int msg_ver(char *bs) {
+    if (is_compact(bs))
+        return MSGVER_COMPACT;
+    if (memcmp(MSG_WIRE(bs)->ver, "1.0", 4) == 0)
+        return MSGVER_VARLEN;
+    if (memcmp(MSG_WIRE(bs)->ver, "2.0", 4) == 0)
+        return MSGVER_COMPACT;
+    return MSGVER_FIXED;
+}
+
+// msgno -> descriptor dispatch table.
+#define MSG_DESC_ENTRY(T, t, NAME, no, FIELDS) [no] = &_msgdesc_##t,
+static const msgdesc_t *_msgdescs[MSGNO_MAX] = {
+    MSG_TYPES(MSG_DESC_ENTRY)
+};
+
+// Set mv from the header of the message at bs, full or compact, without
+// looking at the body. len is the number of bytes available at bs.
+// Returns 0 on success, 1 if more bytes are needed, -1 for malformed
+// header (the message length can't be known).
+int view_msg_header(char *bs, size_t len, MsgView *mv) {
+    if (len < 1)
+        return 1;
+
+    if (is_compact(bs)) {
+        int flags = bs[0] & MSG_FLAGS_MASK;
+        if (flags & ~(MSG_FLAG_CRC | MSG_FLAG_LZ))
+            return -1;
+        char *p = bs + 1;
+        char *end = bs + (len < MSG_COMPACT_HEADER_MAX ? len : MSG_COMPACT_HEADER_MAX);
+        uint32_t msgno, bodylen;
+        if (varint_get(&p, end, &msgno) == -1 || varint_get(&p, end, &bodylen) == -1)
+            return len < MSG_COMPACT_HEADER_MAX ? 1 : -1;
+        if (msgno > INT16_MAX || bodylen > MSG_MAX_BODYLEN)
+            return -1;
+        mv->msgno = msgno;
+        mv->bodylen = bodylen;
+        mv->ver = MSGVER_COMPACT;
+        mv->flags = flags;
+        mv->bs = bs;
+        mv->body = p;
+        mv->msglen = p - bs + bodylen + (flags & MSG_FLAG_CRC ? MSG_CRC_LEN : 0);
+        return 0;
+    }
+
+    if (len < MSG_HEADER_LEN)
+        return 1;
+    short bodylen = ntohs(MSG_WIRE(bs)->bodylen);
+    if (bodylen < 0 || bodylen > MSG_MAX_BODYLEN)
+        return -1;
+    mv->msgno = ntohs(MSG_WIRE(bs)->msgno);
+    mv->bodylen = bodylen;
+    mv->ver = msg_ver(bs);
+    mv->flags = 0;
+    mv->bs = bs;
+    mv->body = MSG_OFFSET_BODY(bs);
+    mv->msglen = MSG_HEADER_LEN + bodylen;
+    return 0;
+}
+
+// Return checksum in trailer of message viewed by mv (MSG_FLAG_CRC).
+uint32_t msg_crc(MsgView *mv) {
+    return get_le32(mv->bs + mv->msglen - MSG_CRC_LEN);
+}
+
+// Check the trailer of a MSG_FLAG_CRC message. view_msg_bytes() doesn't,
+// so that a stream reader can checksum bytes as they arrive instead.
+// Returns 1 if the checksum matches or the message has none, else 0.
+int msg_crc_ok(MsgView *mv) {
+    if (!(mv->flags & MSG_FLAG_CRC))
+        return 1;
+    return crc32c(0, mv->bs, mv->msglen - MSG_CRC_LEN) == msg_crc(mv);
+}
+
+// Set mv to refer to the message at bs without copying or allocating.
+// len is the number of bytes available at bs.
+// Returns 0 on success, 1 if more bytes are needed, -1 for invalid message.
+int view_msg_bytes(char *bs, size_t len, MsgView *mv) {
+    int z = view_msg_header(bs, len, mv);
+    if (z != 0)
+        return z;
+    if (len < mv->msglen)
+        return 1;
+
+    short msgno = mv->msgno;
+    int ver = mv->ver;
+
+    // Only a hello may have a full header with version "2.0".
+    if (msgno == MSGNO_HELLO)
+        return ver == MSGVER_COMPACT && !is_compact(bs) && hello_flags(mv) != -1 ? 0 : -1;
+    if (ver == MSGVER_COMPACT && !is_compact(bs))
+        return -1;
+
+    const msgdesc_t *desc = msg_desc(msgno);
+    if (desc == NULL && !(msgno == MSGNO_BATCH && ver != MSGVER_FIXED))
+        return -1;
+    // A compressed body is checked when inflated, by msg_inflate().
+    if (mv->flags & MSG_FLAG_LZ)
+        return 0;
+    if (ver == MSGVER_FIXED && mv->bodylen != desc->bodylen)
+        return -1;
+
+    // Every message in a batch must be valid and they must exactly fill
+    // the body.
+    if (msgno == MSGNO_BATCH) {
+        MsgView sub;
+        int off = 0;
+        int z;
+        int count = 0;
+        while ((z = view_batch_next(mv, &off, &sub)) == 1)
+            count++;
+        if (z == -1 || count == 0)
+            return -1;
+        return 0;
+    }
+
+    // Variable length fields must exactly fill the body.
+    if (ver != MSGVER_FIXED) {
+        AnyMsgView v;
+        if (desc->view(mv, &v) == -1)
+            return -1;
+    }
+    return 0;
 }
 
+// Set mv to the message at offset *off of batch body and advance *off
+// past it. mv->bs and mv->msglen cover the message's batch entry.
+// Returns 1 for a message, 0 at end of batch, -1 for invalid message.
+int view_batch_next(MsgView *batch, int *off, MsgView *mv) {
+    if (*off >= batch->bodylen)
+        return 0;
+
+    char *p = batch->body + *off;
+    char *end = batch->body + batch->bodylen;
+    uint32_t msgno, bodylen;
+    if (varint_get(&p, end, &msgno) == -1 || varint_get(&p, end, &bodylen) == -1)
+        return -1;
+    if (msgno >= MSGNO_MAX || bodylen > end - p)
+        return -1;
+    const msgdesc_t *desc = msg_desc(msgno);
+    if (desc == NULL)
+        return -1;
+
+    mv->msgno = msgno;
+    mv->bodylen = bodylen;
+    mv->ver = MSGVER_VARLEN;
+    mv->flags = 0;
+    mv->bs = batch->body + *off;
+    mv->body = p;
+    mv->msglen = p + bodylen - mv->bs;
+
+    AnyMsgView v;
+    if (desc->view(mv, &v) == -1)
+        return -1;
+    *off += mv->msglen;
+    return 1;
+}
+
+// Copy viewed message into a newly allocated message struct that
+// outlives the wire bytes. Free with free_msg().
+// Returns NULL if msgno not supported.
+void *materialize_msg(MsgView *mv) {
+    const msgdesc_t *desc = msg_desc(mv->msgno);
+    AnyMsgView v;
+    if (desc == NULL || desc->view(mv, &v) == -1) {
+        log_warn("materialize_msg(): msgno %d not supported.", mv->msgno);
+        return NULL;
+    }
+    return desc->decode(&v);
+}
+
+// bs must hold a complete message.
 void *unpack_msg_bytes(char *bs) {
-    short msgno = ntohs(*MSG_OFFSET_MSGNO(bs));
-    short bodylen = ntohs(*MSG_OFFSET_BODYLEN(bs));
+    MsgView mv;
+    if (view_msg_header(bs, MSG_HEADER_LEN, &mv) == -1) {
+        log_warn("unpack_msg_bytes(): invalid message header");
+        return NULL;
+    }
 
-    printf("unpack_msg_bytes() msgno: %d, bodylen: %d\n", msgno, bodylen);
+    log_debug("unpack_msg_bytes() msgno: %d, bodylen: %d", mv.msgno, mv.bodylen);
 
-    if (lookup_bodylen(msgno) != bodylen) {
-        printf("unpack_msg_bytes(): invalid message (msgno: %d, bodylen: %d)\n", msgno, bodylen);
+    if (view_msg_bytes(bs, mv.msglen, &mv) != 0) {
+        log_warn("unpack_msg_bytes(): invalid message (msgno: %d, bodylen: %d)", mv.msgno, mv.bodylen);
         return NULL;
     }
+    return materialize_msg(&mv);
+}
+
+// Length of header of a ver message.
+static int header_len(int ver, short msgno, short bodylen) {
+    if (ver == MSGVER_COMPACT)
+        return 1 + varint_len(msgno) + varint_len(bodylen);
+    return MSG_HEADER_LEN;
+}
+
+// Length of trailer for flags.
+static inline int trailer_len(int flags) {
+    return flags & MSG_FLAG_CRC ? MSG_CRC_LEN : 0;
+}
+
+// Write header of a ver message into bs. A MSGVER_COMPACT header is
+// written compact, with flags; the hello is written by pack_hello().
+// Returns pointer to message body.
+static char *write_header(char *bs, int ver, int flags, short msgno, short bodylen) {
+    if (ver == MSGVER_COMPACT) {
+        char *p = bs;
+        *p++ = MSG_MAGIC | flags;
+        p = varint_put(p, msgno);
+        return varint_put(p, bodylen);
+    }
+    MsgWireHeader *h = MSG_WIRE(bs);
+    copystr_padzero(h->sig, MSG_SIG, MSG_SIG_LEN);
+    copystr_padzero(h->ver, (char *) _msgver_strs[ver], MSG_VER_LEN);
+    copystr_padzero(h->agent, MSG_AGENT, MSG_AGENT_LEN);
+    h->msgno = htons(msgno);
+    h->bodylen = htons(bodylen);
+    return MSG_OFFSET_BODY(bs);
+}
+
+// Write header and body of message viewed by v into bs.
+// bs should have room for header_len() + bodylen bytes.
+static void write_msg(char *bs, const msgdesc_t *desc, int ver, void *v, short bodylen) {
+    char *body = write_header(bs, ver, 0, desc->msgno, bodylen);
+    desc->encode(body, ver, v);
+}
+
+static short msg_bodylen(const msgdesc_t *desc, int ver, void *v) {
+    if (ver == MSGVER_FIXED)
+        return desc->bodylen;
+    return desc->varbodylen(v);
+}
+
+// Compress bodylen bytes of body into _lzbody, prefixed with bodylen.
+// Returns compressed body length, or 0 if it wouldn't be shorter.
+static int compress_body(char *body, short bodylen) {
+    char *p = varint_put(_lzbody, bodylen);
+    int n = lz_compress(body, bodylen, p, bodylen - (p - _lzbody) - 1);
+    return n > 0 ? p - _lzbody + n : 0;
+}
+
+// Append a MSGVER_COMPACT message with the given body to buf, which must
+// not hold the body. Returns number of bytes appended.
+static int write_compact_buf(buf_t *buf, int flags, short msgno, char *body, short bodylen) {
+    int lzlen = 0;
+    if ((flags & MSG_FLAG_LZ) && bodylen >= MSG_LZ_MINLEN)
+        lzlen = compress_body(body, bodylen);
+    if (lzlen > 0) {
+        body = _lzbody;
+        bodylen = lzlen;
+    } else {
+        flags &= ~MSG_FLAG_LZ;
+    }
+
+    int len = header_len(MSGVER_COMPACT, msgno, bodylen) + bodylen;
+    int msglen = len + trailer_len(flags);
+    char *bs = buf_reserve(buf, msglen);
+    char *p = write_header(bs, MSGVER_COMPACT, flags, msgno, bodylen);
+    memcpy(p, body, bodylen);
+    if (flags & MSG_FLAG_CRC)
+        put_le32(bs + len, crc32c(0, bs, len));
+    buf_commit(buf, msglen);
+    return msglen;
+}
 
-    if (msgno == TEXTMSG_NO) {
-        TextMsg *m = malloc(sizeof(TextMsg));
-        m->msgno = msgno;
-        assign_sz(m->alias, TEXTMSG_OFFSET_ALIAS(bs), TEXTMSG_ALIAS_LEN);
-        assign_sz(m->text, TEXTMSG_OFFSET_TEXT(bs), TEXTMSG_TEXT_LEN);
-        return m;
+// Encode message viewed by v at the end of buf, with a trailer and
+// compression for flags. flags apply only to MSGVER_COMPACT.
+static int write_msg_buf(buf_t *buf, const msgdesc_t *desc, int ver, int flags, void *v) {
+    if (ver != MSGVER_COMPACT)
+        flags = 0;
+    short bodylen = msg_bodylen(desc, ver, v);
+
+    // Bodies that may be compressed are encoded aside first.
+    if ((flags & MSG_FLAG_LZ) && bodylen >= MSG_LZ_MINLEN) {
+        desc->encode(_lzraw, ver, v);
+        return write_compact_buf(buf, flags, desc->msgno, _lzraw, bodylen);
     }
+    flags &= ~MSG_FLAG_LZ;
 
-    printf("unpack_msg_bytes(): msgno %d not supported.\n", msgno);
-    return NULL;
+    int len = header_len(ver, desc->msgno, bodylen) + bodylen;
+    int msglen = len + trailer_len(flags);
+    char *bs = buf_reserve(buf, msglen);
+    char *body = write_header(bs, ver, flags, desc->msgno, bodylen);
+    desc->encode(body, ver, v);
+    if (flags & MSG_FLAG_CRC)
+        put_le32(bs + len, crc32c(0, bs, len));
+    buf_commit(buf, msglen);
+    return msglen;
 }
 
 char *pack_msg(void *msg) {
-    short msgno = MSGNO(msg);
-    short bodylen = lookup_bodylen(msgno);
-    if (bodylen < 0) {
-        printf("pack_msg(): invalid message (msgno: %d)\n", msgno);
+    const msgdesc_t *desc = msg_desc(MSGNO(msg));
+    if (desc == NULL) {
+        log_warn("pack_msg(): invalid message (msgno: %d)", MSGNO(msg));
         return NULL;
     }
-    printf("pack_msg() msgno: %d, bodylen: %d\n", msgno, bodylen);
+    AnyMsgView v;
+    desc->viewstruct(msg, &v);
+    short bodylen = msg_bodylen(desc, MSGVER_DEFAULT, &v);
+    log_debug("pack_msg() msgno: %d, bodylen: %d", desc->msgno, bodylen);
+
+    char *bs = malloc(header_len(MSGVER_DEFAULT, desc->msgno, bodylen) + bodylen);
+    write_msg(bs, desc, MSGVER_DEFAULT, &v, bodylen);
+    return bs;
+}
+
+// Encode msg in place at the end of buf.
+// Returns number of bytes appended or -1 for invalid message.
+int pack_msg_buf(void *msg, buf_t *buf) {
+    return pack_msg_buf_ver(msg, MSGVER_DEFAULT, buf);
+}
+
+// Encode msg at the end of buf in body format ver (MSGVER_*).
+// Returns number of bytes appended or -1 for invalid message.
+int pack_msg_buf_ver(void *msg, int ver, buf_t *buf) {
+    return pack_msg_buf_flags(msg, ver, 0, buf);
+}
+
+// Encode msg at the end of buf in body format ver, with compact header
+// flags (MSG_FLAG_*, MSGVER_COMPACT only).
+// Returns number of bytes appended or -1 for invalid message.
+int pack_msg_buf_flags(void *msg, int ver, int flags, buf_t *buf) {
+    const msgdesc_t *desc = msg_desc(MSGNO(msg));
+    if (desc == NULL) {
+        log_warn("pack_msg_buf(): invalid message (msgno: %d)", MSGNO(msg));
+        return -1;
+    }
+    AnyMsgView v;
+    desc->viewstruct(msg, &v);
+    return write_msg_buf(buf, desc, ver, flags, &v);
+}
+
+// Append a hello, the first message of a "2.0" connection, from agent
+// accepting flags (MSG_FLAG_*) to buf. Returns number of bytes appended.
+int pack_hello(char *agent, int flags, buf_t *buf) {
+    int bodylen = flags != 0 ? varint_len(flags) : 0;
+    char *bs = buf_reserve(buf, MSG_HEADER_LEN + bodylen);
+    MsgWireHeader *h = MSG_WIRE(bs);
+    copystr_padzero(h->sig, MSG_SIG, MSG_SIG_LEN);
+    copystr_padzero(h->ver, (char *) _msgver_strs[MSGVER_COMPACT], MSG_VER_LEN);
+    copystr_padzero(h->agent, agent, MSG_AGENT_LEN);
+    h->msgno = htons(MSGNO_HELLO);
+    h->bodylen = htons(bodylen);
+    if (flags != 0)
+        varint_put(MSG_OFFSET_BODY(bs), flags);
+    buf_commit(buf, MSG_HEADER_LEN + bodylen);
+    return MSG_HEADER_LEN + bodylen;
+}
+
+// Return the MSG_FLAG_* flags accepted by the sender of the hello viewed
+// by mv, or -1 if its body is malformed.
+int hello_flags(MsgView *mv) {
+    if (mv->bodylen == 0)
+        return 0;
+    char *p = mv->body;
+    char *end = mv->body + mv->bodylen;
+    uint32_t flags;
+    if (varint_get(&p, end, &flags) == -1 || p != end)
+        return -1;
+    return flags & MSG_FLAGS_MASK;
+}
+
+// Set out to view the message viewed by mv with its body uncompressed.
+// A MSG_FLAG_LZ message is decompressed into a message without flags
+// appended to buf, which must not hold mv; any other is viewed as is.
+// Returns 0 on success or -1 for invalid message.
+int msg_inflate(MsgView *mv, buf_t *buf, MsgView *out) {
+    if (!(mv->flags & MSG_FLAG_LZ)) {
+        *out = *mv;
+        return 0;
+    }
+    char *p = mv->body;
+    char *end = mv->body + mv->bodylen;
+    uint32_t bodylen;
+    if (varint_get(&p, end, &bodylen) == -1 || bodylen > MSG_MAX_BODYLEN)
+        return -1;
+    int msglen = header_len(MSGVER_COMPACT, mv->msgno, bodylen) + bodylen;
+    size_t start = buf_datalen(buf);
+    char *bs = buf_reserve(buf, msglen);
+    char *body = write_header(bs, MSGVER_COMPACT, 0, mv->msgno, bodylen);
+    if (lz_decompress(p, end - p, body, bodylen) != bodylen)
+        return -1;
+    buf_commit(buf, msglen);
+    return view_msg_bytes(buf_data(buf) + start, msglen, out) == 0 ? 0 : -1;
+}
+
+// Encode the message viewed by mv at the end of buf in format ver,
+// without materializing it. Same as repack_msg_flags() with the flags of
+// mv if ver is its format, else none.
+int repack_msg(MsgView *mv, int ver, buf_t *buf) {
+    return repack_msg_flags(mv, ver, ver == mv->ver ? mv->flags : 0, buf);
+}
+
+// Encode the message viewed by mv at the end of buf in format ver, with
+// compact header flags (MSG_FLAG_*, MSGVER_COMPACT only), without
+// materializing it. A batch or compressed message is copied for the same
+// format and flags, a batch is given a new header for another variable
+// length format and written as separate messages for MSGVER_FIXED.
+// Anything else about a compressed message needs it inflated first (see
+// msg_inflate()).
+// Returns number of bytes appended or -1 for invalid message.
+int repack_msg_flags(MsgView *mv, int ver, int flags, buf_t *buf) {
+    if (ver != MSGVER_COMPACT)
+        flags = 0;
+    if (ver == mv->ver && flags == mv->flags && (mv->msgno == MSGNO_BATCH || (flags & MSG_FLAG_LZ))) {
+        buf_append(buf, mv->bs, mv->msglen);
+        return mv->msglen;
+    }
+    if (mv->flags & MSG_FLAG_LZ)
+        return -1;
 
-    char *bs = malloc(MSG_HEADER_LEN + bodylen);
-    memset(bs, 0, MSG_HEADER_LEN + bodylen);
+    if (mv->msgno == MSGNO_BATCH) {
+        if (ver == MSGVER_COMPACT)
+            return write_compact_buf(buf, flags, MSGNO_BATCH, mv->body, mv->bodylen);
+        if (ver == MSGVER_VARLEN) {
+            int msglen = header_len(ver, MSGNO_BATCH, mv->bodylen) + mv->bodylen;
+            char *bs = buf_reserve(buf, msglen);
+            char *body = write_header(bs, ver, 0, MSGNO_BATCH, mv->bodylen);
+            memcpy(body, mv->body, mv->bodylen);
+            buf_commit(buf, msglen);
+            return msglen;
+        }
+        MsgView sub;
+        int off = 0;
+        int n = 0;
+        while (view_batch_next(mv, &off, &sub) == 1) {
+            int z = repack_msg(&sub, ver, buf);
+            if (z == -1)
+                return -1;
+            n += z;
+        }
+        return n;
+    }
 
-    copystr_padzero(MSG_OFFSET_SIG(bs), MSG_SIG, MSG_SIG_LEN);
-    copystr_padzero(MSG_OFFSET_VER(bs), MSG_VER, MSG_VER_LEN);
-    copystr_padzero(MSG_OFFSET_AGENT(bs), MSG_AGENT, MSG_AGENT_LEN);
-    *MSG_OFFSET_MSGNO(bs) = htons(msgno);
-    *MSG_OFFSET_BODYLEN(bs) = htons(bodylen);
+    const msgdesc_t *desc = msg_desc(mv->msgno);
+    AnyMsgView v;
+    if (desc == NULL || desc->view(mv, &v) == -1)
+        return -1;
+    return write_msg_buf(buf, desc, ver, flags, &v);
+}
+
+// Length of header of a batch being built, whose bodylen is filled in
+// by batch_end().
+static int batch_header_len(int ver) {
+    return ver == MSGVER_COMPACT ? 1 + varint_len(MSGNO_BATCH) + 2 : MSG_HEADER_LEN;
+}
 
-    if (msgno == TEXTMSG_NO) {
-        TextMsg *textmsg = msg;
-        copystr_padzero(TEXTMSG_OFFSET_ALIAS(bs), textmsg->alias, TEXTMSG_ALIAS_LEN);
-        copystr_padzero(TEXTMSG_OFFSET_TEXT(bs), textmsg->text, TEXTMSG_TEXT_LEN);
-        return bs;
+// Set up b for building ver (MSGVER_VARLEN or MSGVER_COMPACT) batches,
+// with compact header flags (MSG_FLAG_*).
+void batch_init(MsgBatch *b, int ver, int flags) {
+    assert(ver == MSGVER_VARLEN || ver == MSGVER_COMPACT);
+    b->start = 0;
+    b->count = 0;
+    b->ver = ver;
+    b->flags = ver == MSGVER_COMPACT ? flags : 0;
+}
+
+// Add msg to the batch being built at the end of buf, starting a new batch
+// if none is open. The batch is ended when it reaches MSG_BATCH_MAX
+// messages, and before msg if msg would overflow MSG_MAX_BODYLEN.
+// Returns number of messages in the open batch (0 if msg ended it),
+// or -1 for invalid message.
+int batch_add(MsgBatch *b, buf_t *buf, void *msg) {
+    const msgdesc_t *desc = msg_desc(MSGNO(msg));
+    if (desc == NULL) {
+        log_warn("batch_add(): invalid message (msgno: %d)", MSGNO(msg));
+        return -1;
+    }
+    AnyMsgView v;
+    desc->viewstruct(msg, &v);
+    short bodylen = desc->varbodylen(&v);
+    int entrylen = varint_len(desc->msgno) + varint_len(bodylen) + bodylen;
+
+    int hdrlen = batch_header_len(b->ver);
+    if (b->count > 0) {
+        size_t batchlen = buf_datalen(buf) - b->start - hdrlen;
+        if (batchlen + entrylen > MSG_MAX_BODYLEN)
+            batch_end(b, buf);
+    }
+    if (b->count == 0) {
+        b->start = buf_datalen(buf);
+        char *bs = buf_reserve(buf, hdrlen);
+        if (b->ver == MSGVER_COMPACT) {
+            bs[0] = MSG_MAGIC | (b->flags & ~MSG_FLAG_LZ);
+            char *p = varint_put(bs + 1, MSGNO_BATCH);
+            varint_put2(p, 0);
+        } else {
+            write_header(bs, b->ver, 0, MSGNO_BATCH, 0);
+        }
+        buf_commit(buf, hdrlen);
     }
 
-    free(bs);
-    printf("pack_msg(): msgno %d not supported.\n", msgno);
-    return NULL;
+    char *p = buf_reserve(buf, entrylen);
+    p = varint_put(p, desc->msgno);
+    p = varint_put(p, bodylen);
+    desc->encode(p, MSGVER_VARLEN, &v);
+    buf_commit(buf, entrylen);
+    b->count++;
+
+    if (b->count == MSG_BATCH_MAX)
+        batch_end(b, buf);
+    return b->count;
 }
 
+// Finish the open batch, if any, by filling in its body length,
+// compressing it in place and appending its trailer.
+void batch_end(MsgBatch *b, buf_t *buf) {
+    if (b->count == 0)
+        return;
+    char *bs = buf_data(buf) + b->start;
+    int hdrlen = batch_header_len(b->ver);
+    short bodylen = buf_datalen(buf) - b->start - hdrlen;
+    if ((b->flags & MSG_FLAG_LZ) && bodylen >= MSG_LZ_MINLEN) {
+        int lzlen = compress_body(bs + hdrlen, bodylen);
+        if (lzlen > 0) {
+            memcpy(bs + hdrlen, _lzbody, lzlen);
+            buf_stripright(buf, bodylen - lzlen);
+            bodylen = lzlen;
+            bs[0] |= MSG_FLAG_LZ;
+        }
+    }
+    if (b->ver == MSGVER_COMPACT)
+        varint_put2(bs + hdrlen - 2, bodylen);
+    else
+        MSG_WIRE(bs)->bodylen = htons(bodylen);
+    if (b->flags & MSG_FLAG_CRC) {
+        uint32_t crc = crc32c(0, bs, hdrlen + bodylen);
+        put_le32(buf_reserve(buf, MSG_CRC_LEN), crc);
+        buf_commit(buf, MSG_CRC_LEN);
+    }
+    b->count = 0;
+}
@@ -1,15 +1,18 @@
 #ifndef MSG_H
 #define MSG_H
 
-// Message numbers
-#define TEXTMSG_NO 100
+#include <stdint.h>
+#include "msgdefs.h"
 
 // Maximum size of message body
 #define MSG_MAX_BODYLEN 10000
 
+// Message numbers are below MSGNO_MAX.
+#define MSGNO_MAX 256
+
 // Message header binary format:
 // [4 bytes] protocol signature (Hardcoded to "TINY")
-// [5 bytes] protocol version number (Ex. "0.9", "1.1", "22.99")
+// [5 bytes] protocol version number (Ex. "0.9", "1.0")
 // [16 bytes] agent name (Ex. "tinyclient", "tinyserver")
 // [2 bytes] 16-bit int specifying message number (Ex. 100, 101)
 // [2 bytes] 16-bit int specifying the number of bytes in message body
@@ -17,7 +20,7 @@
 // Ascii fields are always right padded with nulls to fill space.
 #define MSG_SIG         "TINY"
 #define MSG_SIG_LEN     4
-#define MSG_VER         "0.9"
+#define MSG_VER         "1.0"
 #define MSG_VER_LEN     5
 #define MSG_AGENT       "tinyserver"
 #define MSG_AGENT_LEN   16
@@ -25,20 +28,85 @@
 #define MSG_BODYLEN_LEN 2
 #define MSG_HEADER_LEN  (MSG_SIG_LEN + MSG_VER_LEN + MSG_AGENT_LEN + MSG_MSGNO_LEN +  MSG_BODYLEN_LEN)
 
-#define MSG_OFFSET_SIG(p)     ((p) + 0)
-#define MSG_OFFSET_VER(p)     ((p) + MSG_SIG_LEN)
-#define MSG_OFFSET_AGENT(p)   ((p) + MSG_SIG_LEN + MSG_VER_LEN)
-#define MSG_OFFSET_MSGNO(p)   ((short*)((p) + MSG_SIG_LEN + MSG_VER_LEN + MSG_AGENT_LEN))
-#define MSG_OFFSET_BODYLEN(p) ((short*)((p) + MSG_SIG_LEN + MSG_VER_LEN + MSG_AGENT_LEN + MSG_MSGNO_LEN))
-#define MSG_OFFSET_BODY(p)    ((p) + MSG_HEADER_LEN)
+// Wire layout of message header. Packed, so fields may be unaligned;
+// access them through MSG_WIRE(p) and let the compiler do the loads.
+typedef struct __attribute__((packed)) {
+    char sig[MSG_SIG_LEN];
+    char ver[MSG_VER_LEN];
+    char agent[MSG_AGENT_LEN];
+    uint16_t msgno;     // network byte order
+    uint16_t bodylen;   // network byte order
+} MsgWireHeader;
+
+#define MSG_WIRE(p)         ((MsgWireHeader *)(p))
+#define MSG_OFFSET_BODY(p)  ((p) + MSG_HEADER_LEN)
+
+// Compact header, used by "2.0" connections after the handshake:
+// [1 byte] magic, high 4 bits MSG_MAGIC, low 4 bits MSG_FLAG_* flags
+// [varint] message number
+// [varint] number of bytes in message body
+//
+// With MSG_FLAG_CRC the body is followed by a 4 byte trailer, the
+// CRC32C of header and body, least significant byte first. bodylen
+// doesn't count the trailer.
+//
+// With MSG_FLAG_LZ the body is compressed (see lz.h) and sent as
+//   [varint] uncompressed body length
+//   compressed body
+// bodylen and the trailer cover the compressed body. Only bodies of at
+// least MSG_LZ_MINLEN bytes that shrink are sent compressed, and only
+// to a peer whose hello accepts MSG_FLAG_LZ. A batch is compressed
+// whole.
+//
+// Handshake: a "2.0" connection starts with each side sending a hello,
+// a full header with version "2.0", the sender's agent name, msgno
+// MSGNO_HELLO and a body that is either empty or a varint of the
+// MSG_FLAG_* flags the sender accepts in messages to it (MSG_FLAG_LZ).
+// Version and agent are not sent again; every message after the hello
+// has a compact header. A compact stream has no
+// signature to resync on, so a bad magic byte ends the connection, but
+// after a checksum mismatch the next message with a matching checksum
+// can be found.
+#define MSG_MAGIC               0xa0
+#define MSG_MAGIC_MASK          0xf0
+#define MSG_FLAGS_MASK          0x0f
+#define MSG_FLAG_CRC            0x01
+#define MSG_FLAG_LZ             0x02
+#define MSG_CRC_LEN             4
+#define MSG_LZ_MINLEN           128
+#define MSG_COMPACT_HEADER_MAX  11      // magic + two 5 byte varints
+#define MSGNO_HELLO             2
+
+// Body formats, chosen by the header version field:
+// "0.9" (MSGVER_FIXED): each field takes its max length, right padded
+//   with nulls, so bodylen is fixed per msgno.
+// "1.0" (MSGVER_VARLEN): each field is a varint byte count followed by
+//   that many bytes, so bodylen varies up to MSG_MAX_BODYLEN.
+// "2.0" (MSGVER_COMPACT): compact header, 1.0 body.
+// Any other version is read as "0.9". Messages are packed as MSG_VER
+// unless a version is given.
+#define MSGVER_FIXED    0
+#define MSGVER_VARLEN   1
+#define MSGVER_COMPACT  2
+#define MSGVER_COUNT    3
+#define MSGVER_DEFAULT  MSGVER_VARLEN
 
-// TextMsg body binary format:
-#define TEXTMSG_ALIAS_LEN     32
-#define TEXTMSG_TEXT_LEN      255
-#define TEXTMSG_LEN           (TEXTMSG_ALIAS_LEN + TEXTMSG_TEXT_LEN)
+// Batch frame: a 1.0 or 2.0 header with msgno MSGNO_BATCH whose body
+// holds up to MSG_BATCH_MAX messages, each as
+//   [varint msgno] [varint bodylen] [1.0 body]
+// so that a burst of small messages pays for one header and one send.
+#define MSGNO_BATCH     1
+#define MSG_BATCH_MAX   64
 
-#define TEXTMSG_OFFSET_ALIAS(p) (MSG_OFFSET_BODY(p) + 0)
-#define TEXTMSG_OFFSET_TEXT(p)  (MSG_OFFSET_BODY(p) + TEXTMSG_ALIAS_LEN)
+// Batch being built at the end of a buffer. start is relative to
+// buf_data(), so a caller consuming bytes in front of an open batch must
+// subtract them from start.
+typedef struct {
+    size_t start;       // offset of batch header from buf_data()
+    int count;          // messages in open batch, 0 if none open
+    int ver;            // MSGVER_VARLEN or MSGVER_COMPACT
+    int flags;          // MSG_FLAG_* of MSGVER_COMPACT batches
+} MsgBatch;
 
 typedef struct {
     float ver;
@@ -53,15 +121,65 @@ typedef struct {
     short msgno;
 } BaseMsg;
 
+// Zero-copy view of a message in its wire bytes.
+// Pointers refer into the buffer passed to view_msg_bytes() and are only
+// valid as long as those bytes are not consumed or moved.
 typedef struct {
     short msgno;
-    char alias[TEXTMSG_ALIAS_LEN+1];
-    char text[TEXTMSG_TEXT_LEN+1];
-} TextMsg;
+    short bodylen;
+    short ver;      // MSGVER_*
+    short flags;    // MSG_FLAG_* of compact header
+    char *bs;       // start of message (header)
+    char *body;     // start of message body
+    int msglen;     // header + body + trailer length
+} MsgView;
+
+// Declarations generated for each message type T in MSG_TYPES:
+//   NAME_NO, NAME_LEN      msgno and MSGVER_FIXED body length
+//   field length constants
+//   T                      message struct, fields null-terminated
+//   TWire                  packed wire layout of message body
+//   TView, view_t()        zero-copy view of message body; fields are not
+//                          null-terminated, use the lengths.
+#define MSG_FIELD_LENCONST(name, LEN, len)  LEN = len,
+#define MSG_FIELD_SUMLEN(name, LEN, len)    + len
+#define MSG_FIELD_STRUCT(name, LEN, len)    char name[len+1];
+#define MSG_FIELD_WIRE(name, LEN, len)      char name[len];
+#define MSG_FIELD_VIEW(name, LEN, len)      char *name; size_t name##_len;
+
+#define MSG_DECLARE(T, t, NAME, no, FIELDS) \
+    enum { NAME##_NO = no, NAME##_LEN = 0 FIELDS(MSG_FIELD_SUMLEN), FIELDS(MSG_FIELD_LENCONST) }; \
+    typedef struct { short msgno; FIELDS(MSG_FIELD_STRUCT) } T; \
+    typedef struct __attribute__((packed)) { FIELDS(MSG_FIELD_WIRE) } T##Wire; \
+    typedef struct { FIELDS(MSG_FIELD_VIEW) } T##View; \
+    int view_##t(MsgView *mv, T##View *v);
+
+MSG_TYPES(MSG_DECLARE)
 
+int msg_known(short msgno);
+pool_t *msg_pool(short msgno);
+void *alloc_msg(short msgno);
 void free_msg(void *msg);
+int view_msg_header(char *bs, size_t len, MsgView *mv);
+int view_msg_bytes(char *bs, size_t len, MsgView *mv);
+void *materialize_msg(MsgView *mv);
 void *unpack_msg_bytes(char *bs);
 char *pack_msg(void *msg);
+int pack_msg_buf(void *msg, buf_t *buf);
+int pack_msg_buf_ver(void *msg, int ver, buf_t *buf);
+int pack_msg_buf_flags(void *msg, int ver, int flags, buf_t *buf);
+int repack_msg(MsgView *mv, int ver, buf_t *buf);
+int repack_msg_flags(MsgView *mv, int ver, int flags, buf_t *buf);
+int msg_inflate(MsgView *mv, buf_t *buf, MsgView *out);
+int msg_ver(char *bs);
+int pack_hello(char *agent, int flags, buf_t *buf);
+int hello_flags(MsgView *mv);
+void batch_init(MsgBatch *b, int ver, int flags);
+uint32_t msg_crc(MsgView *mv);
+int msg_crc_ok(MsgView *mv);
+int batch_add(MsgBatch *b, buf_t *buf, void *msg);
+void batch_end(MsgBatch *b, buf_t *buf);
+int view_batch_next(MsgView *batch, int *off, MsgView *mv);
 
 #endif
 
@@ -0,0 +1,30 @@
+#ifndef MSGDEFS_H
+#define MSGDEFS_H
+
+// Message schema. Every message type is declared once, here, and msg.h
+// and msg.c expand the declarations into message structs, packed wire
+// layouts, zero-copy views, the msgno dispatch table and per-type
+// encode/decode functions.
+//
+// MSG_TYPES lists each message type as:
+//   X(struct name, function suffix, constant prefix, msgno, field list)
+//
+// A field list declares each field of the message body, in wire order, as:
+//   F(field name, max length constant, max length)
+// Fields are ASCII strings, right padded with nulls on the wire.
+//
+// To add a message type, add its field list and an MSG_TYPES entry.
+
+#define TEXTMSG_FIELDS(F) \
+    F(alias, TEXTMSG_ALIAS_LEN, 32) \
+    F(text, TEXTMSG_TEXT_LEN, 255)
+
+// Asks the server to send the last count (decimal) relayed messages.
+#define REPLAYMSG_FIELDS(F) \
+    F(count, REPLAYMSG_COUNT_LEN, 10)
+
+#define MSG_TYPES(X) \
+    X(TextMsg, textmsg, TEXTMSG, 100, TEXTMSG_FIELDS) \
+    X(ReplayMsg, replaymsg, REPLAYMSG, 101, REPLAYMSG_FIELDS)
+
+#endif
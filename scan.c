@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+#include "scan.h"
+
+typedef long (*find4func_t)(const char *p, size_t len, const char *k);
+typedef size_t (*linesfunc_t)(const char *p, size_t len, linespan_t *lines, size_t maxlines);
+
+static int _impl;
+static find4func_t _find4;
+static linesfunc_t _lines;
+
+static long find4_scalar(const char *p, size_t len, const char *k) {
+    if (len < 4)
+        return -1;
+    uint32_t n;
+    memcpy(&n, k, 4);
+
+    const char *q = p;
+    const char *end = p + len - 3;
+    while (q < end) {
+        q = memchr(q, k[0], end - q);
+        if (q == NULL)
+            return -1;
+        uint32_t v;
+        memcpy(&v, q, 4);
+        if (v == n)
+            return q - p;
+        q++;
+    }
+    return -1;
+}
+
+// Line scanning state carried between blocks.
+typedef struct {
+    size_t start;
+    int32_t colon;
+    size_t n;
+} linestate_t;
+
+// Scan p[i..len) a byte at a time. Returns number of lines in lines.
+static size_t lines_tail(const char *p, size_t i, size_t len, linestate_t *st, linespan_t *lines, size_t maxlines) {
+    for (; i < len && st->n < maxlines; i++) {
+        if (p[i] == '\n') {
+            lines[st->n].off = st->start;
+            lines[st->n].len = i - st->start;
+            lines[st->n].colon = st->colon;
+            st->n++;
+            st->start = i+1;
+            st->colon = -1;
+        } else if (p[i] == ':' && st->colon < 0) {
+            st->colon = i - st->start;
+        }
+    }
+    return st->n;
+}
+
+static size_t lines_scalar(const char *p, size_t len, linespan_t *lines, size_t maxlines) {
+    linestate_t st = {0, -1, 0};
+    return lines_tail(p, 0, len, &st, lines, maxlines);
+}
+
+#ifdef SCAN_X86
+// Add lines ending in a block at p[base..base+64) given the block's bitmasks
+// of newlines and colons.
+static inline void lines_mask(size_t base, uint64_t nlmask, uint64_t colonmask, linestate_t *st, linespan_t *lines, size_t maxlines) {
+    uint64_t mask = nlmask | colonmask;
+    while (mask != 0 && st->n < maxlines) {
+        int bit = __builtin_ctzll(mask);
+        size_t i = base + bit;
+        if (nlmask & (1ULL << bit)) {
+            lines[st->n].off = st->start;
+            lines[st->n].len = i - st->start;
+            lines[st->n].colon = st->colon;
+            st->n++;
+            st->start = i+1;
+            st->colon = -1;
+        } else if (st->colon < 0) {
+            st->colon = i - st->start;
+        }
+        mask &= mask - 1;
+    }
+}
+
+static size_t lines_sse2(const char *p, size_t len, linespan_t *lines, size_t maxlines) {
+    linestate_t st = {0, -1, 0};
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i colon = _mm_set1_epi8(':');
+
+    size_t i = 0;
+    for (; i + 16 <= len && st.n < maxlines; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (p + i));
+        uint64_t nlmask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(a, nl));
+        uint64_t colonmask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(a, colon));
+        lines_mask(i, nlmask, colonmask, &st, lines, maxlines);
+    }
+    return lines_tail(p, i, len, &st, lines, maxlines);
+}
+
+__attribute__((target("avx2")))
+static size_t lines_avx2(const char *p, size_t len, linespan_t *lines, size_t maxlines) {
+    linestate_t st = {0, -1, 0};
+    __m256i nl = _mm256_set1_epi8('\n');
+    __m256i colon = _mm256_set1_epi8(':');
+
+    size_t i = 0;
+    for (; i + 64 <= len && st.n < maxlines; i += 64) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *) (p + i + 32));
+        uint64_t nlmask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, nl)) |
+                          (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, nl)) << 32;
+        uint64_t colonmask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, colon)) |
+                             (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, colon)) << 32;
+        lines_mask(i, nlmask, colonmask, &st, lines, maxlines);
+    }
+    return lines_tail(p, i, len, &st, lines, maxlines);
+}
+
+// Candidates are positions where both the first and last needle bytes
+// match (comparing blocks at p+i and p+i+3); only those are verified with
+// a 4-byte compare, so junk is skipped a whole block at a time.
+static long find4_sse2(const char *p, size_t len, const char *k) {
+    if (len < 4)
+        return -1;
+    uint32_t n;
+    memcpy(&n, k, 4);
+    __m128i first = _mm_set1_epi8(k[0]);
+    __m128i last = _mm_set1_epi8(k[3]);
+
+    // Two blocks per iteration, with a single test when neither has a
+    // candidate (the common case for junk).
+    size_t i = 0;
+    for (; i + 32 + 3 <= len; i += 32) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i b0 = _mm_loadu_si128((const __m128i *) (p + i + 3));
+        __m128i a1 = _mm_loadu_si128((const __m128i *) (p + i + 16));
+        __m128i b1 = _mm_loadu_si128((const __m128i *) (p + i + 16 + 3));
+        __m128i m0 = _mm_and_si128(_mm_cmpeq_epi8(a0, first), _mm_cmpeq_epi8(b0, last));
+        __m128i m1 = _mm_and_si128(_mm_cmpeq_epi8(a1, first), _mm_cmpeq_epi8(b1, last));
+        if (_mm_movemask_epi8(_mm_or_si128(m0, m1)) == 0)
+            continue;
+
+        uint32_t mask = _mm_movemask_epi8(m0) | (uint32_t) _mm_movemask_epi8(m1) << 16;
+        while (mask != 0) {
+            int bit = __builtin_ctz(mask);
+            uint32_t v;
+            memcpy(&v, p + i + bit, 4);
+            if (v == n)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    long z = find4_scalar(p + i, len - i, k);
+    return z == -1 ? -1 : (long) i + z;
+}
+
+__attribute__((target("avx2")))
+static long find4_avx2(const char *p, size_t len, const char *k) {
+    if (len < 4)
+        return -1;
+    uint32_t n;
+    memcpy(&n, k, 4);
+    __m256i first = _mm256_set1_epi8(k[0]);
+    __m256i last = _mm256_set1_epi8(k[3]);
+
+    size_t i = 0;
+    for (; i + 64 + 3 <= len; i += 64) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *) (p + i + 3));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *) (p + i + 32));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *) (p + i + 32 + 3));
+        __m256i m0 = _mm256_and_si256(_mm256_cmpeq_epi8(a0, first), _mm256_cmpeq_epi8(b0, last));
+        __m256i m1 = _mm256_and_si256(_mm256_cmpeq_epi8(a1, first), _mm256_cmpeq_epi8(b1, last));
+        if (_mm256_testz_si256(_mm256_or_si256(m0, m1), _mm256_or_si256(m0, m1)))
+            continue;
+
+        uint64_t mask = (uint32_t) _mm256_movemask_epi8(m0) | (uint64_t) (uint32_t) _mm256_movemask_epi8(m1) << 32;
+        while (mask != 0) {
+            int bit = __builtin_ctzll(mask);
+            uint32_t v;
+            memcpy(&v, p + i + bit, 4);
+            if (v == n)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    long z = find4_sse2(p + i, len - i, k);
+    return z == -1 ? -1 : (long) i + z;
+}
+#endif
+
+// Use scanners of impl. Returns 0 on success or -1 if the CPU doesn't
+// support impl.
+int scan_set_impl(int impl) {
+    if (impl == SCAN_SCALAR) {
+        _find4 = find4_scalar;
+        _lines = lines_scalar;
+#ifdef SCAN_X86
+    } else if (impl == SCAN_SSE2) {
+        _find4 = find4_sse2;
+        _lines = lines_sse2;
+    } else if (impl == SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        _find4 = find4_avx2;
+        _lines = lines_avx2;
+#endif
+    } else {
+        return -1;
+    }
+    _impl = impl;
+    return 0;
+}
+
+// Pick the best supported scanners before main() runs, so that threads
+// never race on the choice.
+__attribute__((constructor))
+static void scan_init() {
+    __builtin_cpu_init();
+    if (scan_set_impl(SCAN_AVX2) == 0)
+        return;
+    if (scan_set_impl(SCAN_SSE2) == 0)
+        return;
+    scan_set_impl(SCAN_SCALAR);
+}
+
+int scan_impl() {
+    return _impl;
+}
+const char *scan_impl_name(int impl) {
+    if (impl == SCAN_AVX2)
+        return "avx2";
+    if (impl == SCAN_SSE2)
+        return "sse2";
+    return "scalar";
+}
+
+// Return offset of first occurrence of the 4 bytes k in p[0..len) or -1
+// if not found.
+long scan_find4(const char *p, size_t len, const char *k) {
+    return _find4(p, len, k);
+}
+
+// Find complete lines in p[0..len), up to maxlines of them, noting the
+// first ':' of each. Bytes after the last '\n' are not a line yet.
+// Returns number of lines stored in lines.
+size_t scan_lines(const char *p, size_t len, linespan_t *lines, size_t maxlines) {
+    return _lines(p, len, lines, maxlines);
+}
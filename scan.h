@@ -0,0 +1,33 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Vectorized byte scanners.
+//
+// Each scanner has a scalar version and, on x86, SSE2 and AVX2 versions.
+// The best one the CPU supports is picked at startup; scan_set_impl()
+// overrides the choice (for benchmarks and testing).
+
+#define SCAN_SCALAR 0
+#define SCAN_SSE2   1
+#define SCAN_AVX2   2
+
+int scan_impl();
+const char *scan_impl_name(int impl);
+int scan_set_impl(int impl);
+
+// Line p[off..off+len), excluding the '\n'. colon is the offset of the
+// first ':' relative to off, or -1 if the line has none.
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+    int32_t colon;
+} linespan_t;
+
+long scan_find4(const char *p, size_t len, const char *k);
+size_t scan_lines(const char *p, size_t len, linespan_t *lines, size_t maxlines);
+
+#endif
+
@@ -6,11 +6,61 @@
 #include <assert.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 #include "clib.h"
 #include "cnet.h"
 #include "msg.h"
+#include "evloop.h"
+#include "uring.h"
+#include "log.h"
+#include "metrics.h"
+#include "scan.h"
+#include "crc32c.h"
 
-#define NREADBYTES 32
+// Capacity kept by a client read buffer between bursts.
+#define READBUF_MINCAP SIZE_TINY
+
+// Output queue watermarks (bytes queued to a client but not yet sent).
+// Reading from a client is paused above OUTQ_HIWAT and resumed once the
+// queue drains below OUTQ_LOWAT. A client that falls OUTQ_MAXBYTES behind
+// is disconnected.
+#define OUTQ_HIWAT    (256*1024)
+#define OUTQ_LOWAT    (64*1024)
+#define OUTQ_MAXBYTES (4*SIZE_MB)
+
+// I/O engines selectable with -e
+enum Engine {
+    ENGINE_EPOLL,
+    ENGINE_URING
+};
+
+// io_uring engine sizing (per worker)
+#define URING_ENTRIES 256
+#define URING_NBUFS   1024
+#define URING_BUFSIZE 4096
+#define URING_CQE_BATCH 64
+
+// io_uring user_data is a clientctx_t pointer (or NULL) tagged with the
+// operation in its low bits.
+#define UOP_ACCEPT 1
+#define UOP_RECV   2
+#define UOP_SEND   3
+#define UOP_WAKE   4
+#define UOP_CANCEL 5
+#define UDATA(p, op)   ((uint64_t) (p) | (op))
+#define UDATA_OP(u)    ((u) & 7)
+#define UDATA_PTR(u)   ((void *) ((u) & ~(uint64_t) 7))
+
+// Formats messages are sent in: MSGVER_* or, to clients accepting
+// MSG_FLAG_LZ, compact with large bodies compressed.
+#define SENDFMT_LZ    MSGVER_COUNT
+#define SENDFMT_COUNT (MSGVER_COUNT+1)
+
+// History of relayed messages, replayed to clients that ask for it (see
+// replay_history()). Default limits, settable with -H and -B.
+#define HISTORY_DEPTH    1024
+#define HISTORY_MAXBYTES SIZE_MB
 
 enum RecvState {
     RECV_SIG,
@@ -22,176 +72,823 @@ typedef struct {
     int fd;
     buf_t *readbuf;
     enum RecvState recvstate;
+    outq_t *outq;
+    int read_paused;
+    int msgver;             // MSGVER_* of client's last message (MSGVER_COMPACT after a hello), used for messages sent to it
+    int peerflags;          // MSG_FLAG_* the client accepts, from its hello
+    uint32_t crc;           // checksum of first crclen bytes of message being received
+    int crclen;
+    int resync;             // compact stream lost message boundaries after a checksum mismatch
+
+    // io_uring engine only
+    int uring_refs;         // in-flight ops referencing ctx, free deferred until 0
+    int closed;             // disconnected, waiting for in-flight ops
+    int recv_armed;         // multishot recv active
+    int recv_cancelling;
+    int flush_pending;      // in _dirty, flushed at end of completion batch
+    int send_inflight;
+    struct msghdr mh;
+    struct iovec iov[OUTQ_IOVMAX];
 } clientctx_t;
 
 void handle_sigint(int sig);
 void handle_sigchld(int sig);
 
+void on_listen_event(evloop_t *loop, int fd, int events, void *ctx);
+void on_client_event(evloop_t *loop, int fd, int events, void *ctx);
+int process_readbuf(clientctx_t *ctx);
+int process_msg(clientctx_t *ctx, MsgView *mv);
+int accept_hello(clientctx_t *ctx, MsgView *mv);
+int send_to_client(clientctx_t *ctx, rbuf_t *rb);
+void broadcast(clientctx_t *sender, rbuf_t *rb);
+rbuf_t *repack_rbuf(rbuf_t *rb, int fmt);
+int flush_client(clientctx_t *ctx);
 void disconnect_client(int fd);
 
 clientctx_t *clientctx_new(int fd);
 void clientctx_free(clientctx_t *ctx);
 void clientctx_reset(clientctx_t *ctx);
-clientctx_t *find_clientctx(array_t *ctxs, int fd);
-void delete_clientctx(array_t *ctxs, int fd);
 
 void print_buf(buf_t *buf);
+void print_pool_stats();
+
+// One relayed message (a batch is one) as rbufs in each format it has
+// been encoded in so far. The rbufs are shared with the output queues
+// they were sent on.
+typedef struct {
+    rbuf_t *byfmt[SENDFMT_COUNT];   // NULL for formats not encoded yet
+    size_t nbytes;                  // bytes held by distinct rbufs
+} histent_t;
+
+// Ring of the most recent relayed messages, oldest dropped first when
+// it holds cap entries or more than maxbytes. Entries are a fixed array
+// allocated once. Every relayed message reaches every worker, so each
+// keeps its own.
+typedef struct {
+    histent_t *ents;
+    int cap;
+    int head;           // oldest entry
+    int len;
+    size_t nbytes;
+    size_t maxbytes;
+} history_t;
+
+void history_init(history_t *h, int cap, size_t maxbytes);
+void history_add(history_t *h, rbuf_t **byfmt);
+int replay_history(clientctx_t *ctx, int n);
+
+// Worker thread. Each worker owns a listening socket (sharing the port
+// through SO_REUSEPORT), an event loop and its connections. Messages for
+// clients of other workers are passed through their inbox.
+typedef struct {
+    int id;
+    pthread_t thread;
+    int listenfd;
+    mpscq_t *inbox;     // rbufs to broadcast to this worker's clients
+    int wakefd;         // eventfd signalled when inbox gets items
+    int wake_pending;   // set while a wakeup is outstanding
+} worker_t;
 
-fd_set _readfds;
-int _maxfd=0;
-array_t *_ctxs;
-array_t *_received_msgs;
+void *worker_run(void *arg);
+void worker_run_uring(worker_t *w);
+void on_wake_event(evloop_t *loop, int fd, int events, void *ctx);
+void on_uring_cqe(worker_t *w, uint64_t udata, int res, unsigned flags);
+void drain_inbox(worker_t *w);
+static void uring_flush_dirty();
+static void uring_unref_ctx(clientctx_t *ctx);
+static void update_client_watermarks(clientctx_t *ctx);
+void post_to_workers(rbuf_t *rb);
+
+worker_t *_workers;
+int _nworkers = 1;
+enum Engine _engine = ENGINE_EPOLL;
+volatile sig_atomic_t _stopping = 0;   // set by SIGINT, workers then exit
+
+// Per worker thread state
+__thread worker_t *_worker;
+__thread evloop_t *_loop;          // ENGINE_EPOLL
+__thread uring_t *_ring;           // ENGINE_URING
+__thread array_t *_dirty;          // clients with output queued in current batch
+__thread uint64_t _wakecount;
+__thread char _spillbuf[NET_SPILLSIZE];
+__thread pool_t *_ctxpool;
+__thread fdtbl_t *_ctxs;
+__thread history_t _history;
+int _histdepth = HISTORY_DEPTH;
+size_t _histmaxbytes = HISTORY_MAXBYTES;
+__thread buf_t *_packbuf;          // scratch for re-encoding messages
+__thread buf_t *_inflatebuf;       // scratch for decompressed messages
+__thread buf_t *_repackbuf;        // scratch for messages inflated to repack
+__thread buf_t *_relaybuf;         // scratch for batches rebuilt to be relayed
 
 int main(int argc, char *argv[]) {
     int z;
-    int s0;
     struct sockaddr sa;
     char *hostname = "localhost";
     char *port = "8001";
     str_t *serveripaddr = str_new(0);
+    char *logfile = NULL;
+    int loglevel = LOG_INFO;
+    char *adminpath = "/tmp/t-admin.sock";
+
+    while ((z = getopt(argc, argv, "w:e:l:va:H:B:")) != -1) {
+        if (z == 'w') {
+            _nworkers = atoi(optarg);
+        } else if (z == 'e' && strcmp(optarg, "epoll") == 0) {
+            _engine = ENGINE_EPOLL;
+        } else if (z == 'e' && strcmp(optarg, "uring") == 0) {
+            _engine = ENGINE_URING;
+        } else if (z == 'l') {
+            logfile = optarg;
+        } else if (z == 'v') {
+            loglevel = LOG_DEBUG;
+        } else if (z == 'a') {
+            adminpath = optarg;
+        } else if (z == 'H') {
+            _histdepth = atoi(optarg);
+        } else if (z == 'B') {
+            _histmaxbytes = atol(optarg);
+        } else {
+            printf("Usage: t [-w nworkers] [-e epoll|uring] [-l logfile] [-v] [-a adminsock] [-H histdepth] [-B histbytes]\n");
+            printf("  -H  relayed messages kept for replay, per worker (default %d, 0 for none)\n", HISTORY_DEPTH);
+            printf("  -B  max bytes of relayed messages kept for replay, per worker (default %d)\n", HISTORY_MAXBYTES);
+            return 1;
+        }
+    }
+    if (_nworkers < 1)
+        _nworkers = 1;
+    if (_histdepth < 0)
+        _histdepth = 0;
+
+    // Worker 0 runs on the main thread.
+    log_set_thread_name("w0");
+    log_open(logfile, loglevel);
+    atexit(log_close);
+
+    if (_engine == ENGINE_URING) {
+        uring_t *ring = uring_new(URING_ENTRIES, URING_NBUFS, URING_BUFSIZE);
+        if (ring == NULL) {
+            log_warn("io_uring not available (%s), falling back to epoll", strerror(errno));
+            _engine = ENGINE_EPOLL;
+        } else {
+            uring_free(ring);
+        }
+    }
 
     signal(SIGPIPE, SIG_IGN);           // Don't abort on SIGPIPE
-    signal(SIGINT, handle_sigint);      // exit on CTRL-C
     signal(SIGCHLD, handle_sigchld);
 
-    s0 = open_listen_sock(hostname, port, 50, &sa);
-    if (s0 == -1) {
-        print_error("open_listen_sock()");
-        return 1;
+    if (raise_fd_limit() == -1)
+        print_error("raise_fd_limit()");
+
+    // Metrics are served as text to whoever connects, e.g.
+    // socat - UNIX-CONNECT:/tmp/t-admin.sock
+    if (metrics_serve(adminpath) == -1)
+        log_warn("metrics_serve(%s): %s", adminpath, strerror(errno));
+    else
+        log_info("Metrics on unix socket %s", adminpath);
+
+    _workers = calloc(_nworkers, sizeof(worker_t));
+    for (int i=0; i < _nworkers; i++) {
+        worker_t *w = &_workers[i];
+        w->id = i;
+        w->listenfd = open_listen_sock(hostname, port, SOMAXCONN,
+                                       _nworkers > 1 ? LISTEN_REUSEPORT : 0, &sa);
+        if (w->listenfd == -1) {
+            print_error("open_listen_sock()");
+            return 1;
+        }
+        // io_uring returns EAGAIN instead of waiting on non-blocking fds.
+        if (_engine == ENGINE_EPOLL)
+            set_sock_nonblocking(w->listenfd);
+        w->inbox = mpscq_new();
+        w->wakefd = eventfd(0, EFD_CLOEXEC | (_engine == ENGINE_EPOLL ? EFD_NONBLOCK : 0));
+        if (w->wakefd == -1) {
+            print_error("eventfd()");
+            return 1;
+        }
     }
+    // Workers' wakefds are needed to stop them, so exit on CTRL-C only
+    // once they exist.
+    signal(SIGINT, handle_sigint);
+
     get_ipaddr_string(&sa, serveripaddr);
-    printf("Listening on %s port %s...\n", serveripaddr->s, port);
+    log_info("Listening on %s port %s (%d workers, %s)...", serveripaddr->s, port, _nworkers,
+             _engine == ENGINE_URING ? "io_uring" : "epoll");
+
+    // Worker 0 runs on the main thread.
+    for (int i=1; i < _nworkers; i++) {
+        z = pthread_create(&_workers[i].thread, NULL, worker_run, &_workers[i]);
+        if (z != 0) {
+            errno = z;
+            print_error("pthread_create()");
+            return 1;
+        }
+    }
+    worker_run(&_workers[0]);
+    if (_stopping) {
+        for (int i=1; i < _nworkers; i++)
+            pthread_join(_workers[i].thread, NULL);
+    }
+
+    str_free(serveripaddr);
+    return 0;
+}
+
+void *worker_run(void *arg) {
+    worker_t *w = arg;
+    _worker = w;
+
+    if (w->id != 0) {
+        char name[16];
+        snprintf(name, sizeof(name), "w%d", w->id);
+        log_set_thread_name(name);
+    }
 
-    FD_ZERO(&_readfds);
-    FD_SET(s0, &_readfds);
-    _maxfd = s0;
+    metrics_thread_init();
+    _ctxpool = pool_new("clientctx", sizeof(clientctx_t), 0);
+    _ctxs = fdtbl_new(0, (voidpfunc_t) clientctx_free);
+    history_init(&_history, _histdepth, _histmaxbytes);
+    _packbuf = buf_new(0);
+    _inflatebuf = buf_new(0);
+    _repackbuf = buf_new(0);
+    _relaybuf = buf_new(0);
 
-    _ctxs = array_new(0, (voidpfunc_t) clientctx_free);
-    _received_msgs = array_new(0, (voidpfunc_t) free_msg);
+    if (_engine == ENGINE_URING) {
+        worker_run_uring(w);
+        close(w->listenfd);
+        print_pool_stats();
+        return NULL;
+    }
+
+    _loop = evloop_new();
+    if (_loop == NULL)
+        return NULL;
+    if (evloop_add(_loop, w->listenfd, EV_READ, on_listen_event, NULL) == -1 ||
+        evloop_add(_loop, w->wakefd, EV_READ, on_wake_event, w) == -1) {
+        print_error("evloop_add()");
+        return NULL;
+    }
+    evloop_run(_loop);
+
+    evloop_free(_loop);
+    close(w->listenfd);
+    print_pool_stats();
+    return NULL;
+}
+
+// Event loop of io_uring engine. Each iteration submits all queued
+// sqes and waits for completions in a single io_uring_enter() call.
+void worker_run_uring(worker_t *w) {
+    _ring = uring_new(URING_ENTRIES, URING_NBUFS, URING_BUFSIZE);
+    if (_ring == NULL) {
+        print_error("uring_new()");
+        return;
+    }
+    _dirty = array_new(0, NULL);
+    uring_prep_accept_multishot(_ring, w->listenfd, UDATA(NULL, UOP_ACCEPT));
+    uring_prep_read(_ring, w->wakefd, &_wakecount, sizeof(_wakecount), UDATA(NULL, UOP_WAKE));
+
+    while (!_stopping) {
+        if (uring_submit_and_wait(_ring, 1) == -1)
+            break;
+
+        // Handle a limited batch before submitting again so that sends
+        // queued by the batch go out before more input is taken in.
+        struct io_uring_cqe *cqe;
+        int ncqes = 0;
+        while (ncqes++ < URING_CQE_BATCH && (cqe = uring_peek_cqe(_ring)) != NULL) {
+            uint64_t udata = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(_ring);
+            on_uring_cqe(w, udata, res, flags);
+        }
+        uring_flush_dirty();
+    }
+    array_free(_dirty);
+    uring_free(_ring);
+}
 
+// Send output queued during the last batch of completions, one sendmsg
+// per client covering all of it. The send is tried directly first; only
+// what the socket doesn't take is left to an io_uring sendmsg, which
+// completes once the socket is writable again.
+static void uring_flush_dirty() {
+    for (int i=0; i < _dirty->len; i++) {
+        clientctx_t *ctx = _dirty->items[i];
+        ctx->flush_pending = 0;
+        if (!ctx->closed && !ctx->send_inflight && ctx->outq->count > 0) {
+            size_t nbytes = ctx->outq->nbytes;
+            int z = outq_flush(ctx->fd, ctx->outq);
+            METRIC_ADD(bytes_out, nbytes - ctx->outq->nbytes);
+            if (z == Z_ERR) {
+                print_error("outq_flush()");
+                disconnect_client(ctx->fd);
+            } else if (ctx->outq->count > 0) {
+                memset(&ctx->mh, 0, sizeof(ctx->mh));
+                ctx->mh.msg_iov = ctx->iov;
+                ctx->mh.msg_iovlen = outq_iov(ctx->outq, ctx->iov, OUTQ_IOVMAX);
+                uring_prep_sendmsg(_ring, ctx->fd, &ctx->mh, UDATA(ctx, UOP_SEND));
+                ctx->send_inflight = 1;
+                ctx->uring_refs++;
+            }
+        }
+        if (!ctx->closed)
+            update_client_watermarks(ctx);
+        uring_unref_ctx(ctx);
+    }
+    _dirty->len = 0;
+}
+
+// Arm multishot recv for client.
+static void uring_arm_recv(clientctx_t *ctx) {
+    uring_prep_recv_multishot(_ring, ctx->fd, UDATA(ctx, UOP_RECV));
+    ctx->recv_armed = 1;
+    ctx->uring_refs++;
+}
+// Drop reference held by a finished op, freeing a disconnected ctx
+// once nothing refers to it.
+static void uring_unref_ctx(clientctx_t *ctx) {
+    assert(ctx->uring_refs > 0);
+    ctx->uring_refs--;
+    if (ctx->closed && ctx->uring_refs == 0)
+        clientctx_free(ctx);
+}
+
+void on_uring_cqe(worker_t *w, uint64_t udata, int res, unsigned flags) {
+    int op = UDATA_OP(udata);
+    clientctx_t *ctx = UDATA_PTR(udata);
+
+    if (op == UOP_ACCEPT) {
+        if (res >= 0) {
+            int clientfd = res;
+            set_sock_nodelay(clientfd);
+            clientctx_t *clientctx = clientctx_new(clientfd);
+            fdtbl_set(_ctxs, clientfd, clientctx);
+            uring_arm_recv(clientctx);
+            METRIC_INC(conns_accepted);
+            log_info("new clientfd: %d", clientfd);
+        } else {
+            errno = -res;
+            print_error("accept()");
+        }
+        if (!(flags & IORING_CQE_F_MORE))
+            uring_prep_accept_multishot(_ring, w->listenfd, UDATA(NULL, UOP_ACCEPT));
+        return;
+    }
+    if (op == UOP_WAKE) {
+        drain_inbox(w);
+        uring_prep_read(_ring, w->wakefd, &_wakecount, sizeof(_wakecount), UDATA(NULL, UOP_WAKE));
+        return;
+    }
+    if (op == UOP_RECV) {
+        if (flags & IORING_CQE_F_BUFFER) {
+            unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if (!ctx->closed && res > 0) {
+                buf_append(ctx->readbuf, uring_buf(_ring, bid), res);
+                METRIC_ADD(bytes_in, res);
+            }
+            uring_recycle_buf(_ring, bid);
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+            ctx->recv_armed = 0;
+            ctx->recv_cancelling = 0;
+            if (ctx->closed) {
+                uring_unref_ctx(ctx);
+                return;
+            }
+            ctx->uring_refs--;
+        }
+        if (ctx->closed)
+            return;
+
+        if (res > 0) {
+            if (process_readbuf(ctx) == -1)
+                return;
+            buf_shrink(ctx->readbuf, READBUF_MINCAP);
+        } else if (res == 0) {
+            disconnect_client(ctx->fd);
+            return;
+        } else if (res != -ENOBUFS && res != -ECANCELED) {
+            errno = -res;
+            print_error("recv()");
+            disconnect_client(ctx->fd);
+            return;
+        }
+        // Multishot recv stops when provided buffers run out or when it
+        // was cancelled to pause reading.
+        if (!ctx->recv_armed && !ctx->read_paused)
+            uring_arm_recv(ctx);
+        return;
+    }
+    if (op == UOP_SEND) {
+        ctx->send_inflight = 0;
+        if (ctx->closed) {
+            uring_unref_ctx(ctx);
+            return;
+        }
+        ctx->uring_refs--;
+        if (res < 0) {
+            errno = -res;
+            print_error("sendmsg()");
+            disconnect_client(ctx->fd);
+            return;
+        }
+        outq_consume(ctx->outq, res);
+        METRIC_ADD(bytes_out, res);
+        if (ctx->outq->count > 0)
+            flush_client(ctx);
+        else
+            update_client_watermarks(ctx);
+        return;
+    }
+}
+
+// Other workers posted rbufs to this worker's inbox.
+void on_wake_event(evloop_t *loop, int fd, int events, void *ctx) {
+    uint64_t n;
+    while (read(fd, &n, sizeof(n)) > 0) {
+    }
+    drain_inbox(ctx);
+    if (_stopping)
+        evloop_stop(loop);
+}
+
+// Broadcast rbufs posted by other workers to this worker's clients.
+void drain_inbox(worker_t *w) {
+    // Clear before draining so that a post made during the drain wakes us again.
+    __atomic_store_n(&w->wake_pending, 0, __ATOMIC_SEQ_CST);
+
+    rbuf_t *rb;
+    while ((rb = mpscq_pop(w->inbox)) != NULL) {
+        broadcast(NULL, rb);
+        rbuf_unref(rb);
+    }
+}
+
+// Pass rb to all other workers for broadcast to their clients.
+void post_to_workers(rbuf_t *rb) {
+    uint64_t one = 1;
+    for (int i=0; i < _nworkers; i++) {
+        worker_t *w = &_workers[i];
+        if (w == _worker)
+            continue;
+        mpscq_push(w->inbox, rbuf_ref(rb));
+        if (__atomic_exchange_n(&w->wake_pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            if (write(w->wakefd, &one, sizeof(one)) == -1)
+                print_error("write(wakefd)");
+        }
+    }
+}
+
+// Accept all pending connections on listen socket.
+void on_listen_event(evloop_t *loop, int fd, int events, void *ctx) {
     while (1) {
-        fd_set readfds = _readfds;
-        z = select(_maxfd+1, &readfds, NULL, NULL, NULL);
-        if (z == -1 && errno == EINTR)
+        socklen_t sa_len = sizeof(struct sockaddr_in);
+        struct sockaddr_in sa;
+        int clientfd = accept(fd, (struct sockaddr*)&sa, &sa_len);
+        if (clientfd == -1 && errno == EINTR)
             continue;
-        if (z == -1) {
-            print_error("select()");
-            return 1;
+        if (clientfd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (clientfd == -1) {
+            print_error("accept()");
+            break;
         }
-        if (z == 0) // timeout
+        set_sock_nonblocking(clientfd);
+        set_sock_nodelay(clientfd);
+
+        clientctx_t *clientctx = clientctx_new(clientfd);
+        if (evloop_add(loop, clientfd, EV_READ, on_client_event, clientctx) == -1) {
+            print_error("evloop_add()");
+            clientctx_free(clientctx);
+            close(clientfd);
             continue;
+        }
+        fdtbl_set(_ctxs, clientfd, clientctx);
 
-        for (int i=0; i <= _maxfd; i++) {
-            if (!FD_ISSET(i, &readfds))
-                continue;
+        METRIC_INC(conns_accepted);
+        log_info("new clientfd: %d", clientfd);
+    }
+}
 
-            // New connection
-            if (i == s0) {
-                socklen_t sa_len = sizeof(struct sockaddr_in);
-                struct sockaddr_in sa;
-                int clientfd = accept(s0, (struct sockaddr*)&sa, &sa_len);
-                if (clientfd == -1) {
-                    print_error("accept()");
-                    continue;
-                }
-                // Add client socket to readfds list.
-                FD_SET(clientfd, &_readfds);
-                if (clientfd > _maxfd)
-                    _maxfd = clientfd;
+// Client socket ready to write and/or read.
+// Watch is edge-triggered so keep reading until the socket blocks.
+void on_client_event(evloop_t *loop, int fd, int events, void *pctx) {
+    int z;
+    clientctx_t *ctx = pctx;
+    assert(ctx != NULL);
 
-                clientctx_t *ctx = clientctx_new(clientfd);
-                array_add(_ctxs, ctx);
+    if (events & EV_WRITE) {
+        if (flush_client(ctx) == -1)
+            return;
+    }
 
-                printf("new clientfd: %d\n", clientfd);
-                continue;
-            }
+    while (!ctx->read_paused) {
+        size_t nread = 0;
+        z = recv_buf_readv(fd, ctx->readbuf, _spillbuf, sizeof(_spillbuf), &nread);
+        METRIC_ADD(bytes_in, nread);
+        if (z == Z_ERR) {
+            print_error("recv_buf_readv()");
+            disconnect_client(fd);
+            return;
+        }
+        if (process_readbuf(ctx) == -1)
+            return;
+        if (z == Z_EOF) {
+            disconnect_client(fd);
+            return;
+        }
+        // A short read means the socket is drained, unless the peer hung up
+        // in which case keep reading until EOF is returned.
+        if (z == Z_BLOCK && !(events & EV_ERROR))
+            break;
+    }
+
+    // Give back memory from a burst while the connection is idle.
+    buf_shrink(ctx->readbuf, READBUF_MINCAP);
+}
+
+// Client sent a hello, switch its connection to compact headers and
+// answer with ours. Version and agent aren't sent again after this.
+// Compressed messages are accepted from every client, and sent to those
+// whose hello accepts them.
+// Returns 0 on success, -1 if the client was disconnected.
+int accept_hello(clientctx_t *ctx, MsgView *mv) {
+    if (ctx->msgver == MSGVER_COMPACT)
+        return 0;
+    ctx->msgver = MSGVER_COMPACT;
+    ctx->peerflags = hello_flags(mv);
+    log_info("Client %d hello (agent: '%.*s', flags: 0x%x)", ctx->fd,
+             (int) strnlen(MSG_WIRE(mv->bs)->agent, MSG_AGENT_LEN), MSG_WIRE(mv->bs)->agent,
+             ctx->peerflags);
+
+    buf_clear(_packbuf);
+    pack_hello(MSG_AGENT, MSG_FLAG_LZ, _packbuf);
+    rbuf_t *rb = rbuf_new_copy(buf_data(_packbuf), buf_datalen(_packbuf));
+    int z = send_to_client(ctx, rb);
+    rbuf_unref(rb);
+    return z;
+}
+
+// Only chat text is relayed; other messages are requests to the server.
+static inline int msg_relayed(short msgno) {
+    return msgno == TEXTMSG_NO;
+}
+
+// Decode one received message, viewed by mv.
+// Returns 1 if the message should be relayed to other clients, 0 if not,
+// or -1 if the client was disconnected.
+int process_msg(clientctx_t *ctx, MsgView *mv) {
+    uint64_t t0 = clock_ns();
+    metrics_count_msg(mv->msgno);
+    log_debug("Received message (msgno: %d)", mv->msgno);
 
-            // Client socket data available to read.
-            int readfd = i;
-            //printf("read data from clientfd %d\n", readfd);
+    // Received messages aren't kept: relayed ones are, as sent, in the
+    // history.
+    TextMsgView tv;
+    ReplayMsgView rv;
+    if (view_textmsg(mv, &tv) == 0) {
+        log_debug("TextMsg - alias: '%.*s', text: '%.*s'",
+                  (int) tv.alias_len, tv.alias, (int) tv.text_len, tv.text);
+    } else if (view_replaymsg(mv, &rv) == 0) {
+        char count[REPLAYMSG_COUNT_LEN+1];
+        memcpy(count, rv.count, rv.count_len);
+        count[rv.count_len] = 0;
+        if (replay_history(ctx, atoi(count)) == -1)
+            return -1;
+    }
+    hist_record(&_metrics->decode_ns, clock_ns() - t0);
 
-            clientctx_t *ctx = find_clientctx(_ctxs, readfd);
-            assert(ctx != NULL);
+    return msg_relayed(mv->msgno);
+}
 
-            buf_t *readbuf = ctx->readbuf;
+// Copy len bytes of a validated frame from ctx to an rbuf and queue it
+// to all other clients.
+static void relay_frame(clientctx_t *ctx, char *bs, int len) {
+    rbuf_t *rb = rbuf_new_copy(bs, len);
+    broadcast(ctx, rb);
+    post_to_workers(rb);
+    rbuf_unref(rb);
+}
 
-            while (1) {
-                z = recv_buf(readfd, readbuf, NREADBYTES, NULL);
-                if (z == Z_ERR) {
-                    print_error("recv_bytes()");
+// Relay the messages of batch that are relayed, leaving out the rest, as
+// new batches of format ver with flags like the received one.
+static void relay_batch_part(clientctx_t *ctx, MsgView *batch, int ver, int flags) {
+    MsgBatch b;
+    MsgView sub;
+    int off = 0;
+    buf_clear(_relaybuf);
+    batch_init(&b, ver, flags);
+    while (view_batch_next(batch, &off, &sub) == 1) {
+        if (!msg_relayed(sub.msgno))
+            continue;
+        void *msg = materialize_msg(&sub);
+        if (msg == NULL)
+            continue;
+        batch_add(&b, _relaybuf, msg);
+        free_msg(msg);
+    }
+    batch_end(&b, _relaybuf);
+
+    // A received batch can hold more messages than are put in one.
+    MsgView fv;
+    int start = 0;
+    while (start < buf_datalen(_relaybuf) &&
+           view_msg_header(buf_data(_relaybuf) + start, buf_datalen(_relaybuf) - start, &fv) == 0) {
+        relay_frame(ctx, buf_data(_relaybuf) + start, fv.msglen);
+        start += fv.msglen;
+    }
+}
+
+// Return first byte in len bytes at p that could start a compact header
+// with MSG_FLAG_CRC, or NULL.
+static char *find_crc_magic(char *p, size_t len) {
+    for (size_t i=0; i < len; i++) {
+        uint8_t b = p[i];
+        if ((b & MSG_MAGIC_MASK) == MSG_MAGIC && (b & MSG_FLAG_CRC))
+            return p + i;
+    }
+    return NULL;
+}
+
+// Parse all complete messages accumulated in ctx->readbuf.
+// Returns 0 when more bytes are needed, -1 if the client was disconnected,
+// in which case ctx must not be used again.
+int process_readbuf(clientctx_t *ctx) {
+    buf_t *readbuf = ctx->readbuf;
+
+    while (1) {
+        if (ctx->recvstate == RECV_SIG && ctx->msgver == MSGVER_COMPACT) {
+            if (buf_datalen(readbuf) < 1)
+                return 0;
+            if (ctx->resync) {
+                // After a checksum mismatch, message boundaries are lost.
+                // Try each following message with a checksum until one
+                // matches; only a checksum shows where a message starts.
+                char *p = find_crc_magic(buf_data(readbuf), buf_datalen(readbuf));
+                if (p == NULL) {
+                    buf_clear(readbuf);
+                    return 0;
                 }
-                if (z == Z_EOF) {
-                    disconnect_client(readfd);
-                    break;
+                buf_stripleft(readbuf, p - buf_data(readbuf));
+            } else {
+                uint8_t magic = buf_data(readbuf)[0];
+                if ((magic & MSG_MAGIC_MASK) != MSG_MAGIC) {
+                    log_warn("Invalid magic byte in compact header (0x%02x)", magic);
+                    METRIC_INC(msgs_invalid);
+                    disconnect_client(ctx->fd);
+                    return -1;
                 }
+            }
+            ctx->crc = 0;
+            ctx->crclen = 0;
+            ctx->recvstate = RECV_HEADER;
+        } else if (ctx->recvstate == RECV_SIG) {
+            if (buf_datalen(readbuf) < MSG_SIG_LEN)
+                return 0;
 
-                if (ctx->recvstate == RECV_SIG) {
-                    if (readbuf->len < MSG_SIG_LEN)
-                        break;
+            long isig = scan_find4(buf_data(readbuf), buf_datalen(readbuf), MSG_SIG);
+            if (isig != 0)
+                METRIC_INC(resyncs);
+            if (isig == -1) {
+                // Keep the last bytes, they may start a signature that is
+                // completed by the next read. Scanning resumes from them.
+                log_debug("Skipping invalid header bytes.");
+                buf_stripleft(readbuf, buf_datalen(readbuf) - (MSG_SIG_LEN-1));
+                return 0;
+            }
+            buf_stripleft(readbuf, isig);
+            ctx->recvstate = RECV_HEADER;
+        } else if (ctx->recvstate == RECV_HEADER) {
+            MsgView mv;
+            int z = view_msg_header(buf_data(readbuf), buf_datalen(readbuf), &mv);
+            if (z == 1)
+                return 0;
+            // While resyncing, bytes that merely look like a header could
+            // claim a long body and hold up the messages behind them
+            // until it arrives, so insist on a known msgno.
+            if (ctx->resync && (z == -1 || !msg_known(mv.msgno))) {
+                buf_stripleft(readbuf, 1);
+                ctx->recvstate = RECV_SIG;
+                continue;
+            }
+            if (z == -1) {
+                log_warn("Invalid header in message (ver: %d)", ctx->msgver);
+                METRIC_INC(oversized);
+                disconnect_client(ctx->fd);
+                return -1;
+            }
+            ctx->recvstate = RECV_BODY;
+        } else if (ctx->recvstate == RECV_BODY) {
+            MsgView mv;
+            int z = view_msg_header(buf_data(readbuf), buf_datalen(readbuf), &mv);
+            assert(z == 0);
+            int msglen = mv.msglen;
+            short bodylen = mv.bodylen;
 
-                    size_t isig = buf_find(readbuf, MSG_SIG, MSG_SIG_LEN);
-                    if (isig == -1) {
-                        printf("Skipping invalid header bytes.\n");
-                        buf_clear(readbuf);
-                        break;
-                    }
-                    buf_stripleft(readbuf, isig);
-                    ctx->recvstate = RECV_HEADER;
-                } else if (ctx->recvstate == RECV_HEADER) {
-                    if (readbuf->len < MSG_HEADER_LEN)
-                        break;
-
-                    short bodylen = ntohs(*MSG_OFFSET_BODYLEN(readbuf->p));
-                    if (bodylen > MSG_MAX_BODYLEN) {
-                        printf("Invalid bodylen in message (bodylen: %d)\n", bodylen);
-                        ctx->recvstate = RECV_SIG;
-                        disconnect_client(readfd);
-                        break;
-                    }
-                    ctx->recvstate = RECV_BODY;
-                } else if (ctx->recvstate == RECV_BODY) {
-                    short bodylen = ntohs(*MSG_OFFSET_BODYLEN(readbuf->p));
-                    assert(bodylen <= MSG_MAX_BODYLEN);
-                    int msglen = MSG_HEADER_LEN + bodylen;
-
-                    // Received entire message
-                    if (readbuf->len >= msglen) {
-                        void *msg = unpack_msg_bytes(readbuf->p);
-                        if (msg)
-                            array_add(_received_msgs, msg);
-
-                        short msgno = MSGNO(msg);
-                        printf("Received message (msgno: %d)\n", msgno);
-
-                        if (msgno == TEXTMSG_NO) {
-                            TextMsg *tm = (TextMsg *) msg;
-                            printf("TextMsg - alias: '%s', text: '%s'\n", tm->alias, tm->text);
-                        }
-
-                        // Move extra received bytes into start of readbuf.
-                        int nleftover = readbuf->len - msglen;
-                        memcpy(readbuf->p, readbuf->p + msglen, nleftover);
-                        readbuf->len = nleftover;
-                        memset(readbuf->p + readbuf->len, 0, readbuf->cap - readbuf->len);
-
-                        ctx->recvstate = RECV_SIG;
+            // Checksum bytes as they arrive, while they're still in cache,
+            // so that verifying a complete message takes no extra pass.
+            if (mv.flags & MSG_FLAG_CRC) {
+                int n = buf_datalen(readbuf) < msglen - MSG_CRC_LEN ? buf_datalen(readbuf) : msglen - MSG_CRC_LEN;
+                if (n > ctx->crclen) {
+                    ctx->crc = crc32c(ctx->crc, buf_data(readbuf) + ctx->crclen, n - ctx->crclen);
+                    ctx->crclen = n;
+                }
+            }
+
+            if (buf_datalen(readbuf) < msglen)
+                return 0;
+
+            // Corruption is most likely in the body, leaving the length
+            // right, so skip the message and expect the next one right
+            // after it. If the header was corrupt, resync finds the next
+            // message whose checksum matches. A message found while
+            // resyncing may be a false one, so only it is skipped.
+            if ((mv.flags & MSG_FLAG_CRC) && ctx->crc != msg_crc(&mv)) {
+                if (!ctx->resync) {
+                    log_warn("Checksum mismatch in message (msgno: %d, bodylen: %d)", mv.msgno, bodylen);
+                    METRIC_INC(crc_errors);
+                    METRIC_INC(resyncs);
+                    buf_stripleft(readbuf, msglen);
+                } else {
+                    buf_stripleft(readbuf, 1);
+                }
+                ctx->resync = 1;
+                ctx->recvstate = RECV_SIG;
+                continue;
+            }
+            ctx->resync = 0;
+
+            // Received entire message, decode it in place, or from
+            // _inflatebuf if compressed.
+            MsgView plain;
+            buf_clear(_inflatebuf);
+            if (view_msg_bytes(buf_data(readbuf), msglen, &mv) != 0 ||
+                msg_inflate(&mv, _inflatebuf, &plain) != 0) {
+                log_warn("Invalid message (msgno: %d, bodylen: %d)", mv.msgno, bodylen);
+                METRIC_INC(msgs_invalid);
+            } else if (mv.msgno == MSGNO_HELLO) {
+                if (accept_hello(ctx, &mv) == -1)
+                    return -1;
+            } else {
+                ctx->msgver = mv.ver;
+                int relay = 0;
+                int nsubs = 0;
+                int nrelay = 0;
+                if (plain.msgno == MSGNO_BATCH) {
+                    metrics_count_msg(plain.msgno);
+                    MsgView sub;
+                    int off = 0;
+                    while (view_batch_next(&plain, &off, &sub) == 1) {
+                        int z = process_msg(ctx, &sub);
+                        if (z == -1)
+                            return -1;
+                        nsubs++;
+                        nrelay += z;
                     }
+                    relay = nrelay > 0;
+                } else {
+                    relay = process_msg(ctx, &plain);
+                    if (relay == -1)
+                        return -1;
                 }
 
+                // Relay chat text to everyone else. The validated frame is
+                // copied once, as received, and the same rbuf is queued to
+                // all recipients. Batches of only chat text are relayed
+                // whole; the rare batch that also holds requests is
+                // rebuilt without them.
+                if (relay && nrelay < nsubs)
+                    relay_batch_part(ctx, &plain, mv.ver, mv.flags);
+                else if (relay)
+                    relay_frame(ctx, mv.bs, mv.msglen);
             }
-        } // for _maxfd
 
-    } // while (1)
+            // Consume message, leaving any extra received bytes in readbuf.
+            buf_stripleft(readbuf, msglen);
 
-    str_free(serveripaddr);
-    close(s0);
-    return 0;
+            ctx->recvstate = RECV_SIG;
+        }
+    }
 }
 
+// Any thread may get the signal, so only wake all workers here, through
+// their wakefds. Each stops its loop and prints its own stats, and main()
+// exits once they're done.
 void handle_sigint(int sig) {
-    printf("SIGINT received\n");
-    fflush(stdout);
-    exit(0);
+    static const char msg[] = "SIGINT received\n";
+    int tmp_errno = errno;
+    _stopping = 1;
+    if (write(STDOUT_FILENO, msg, sizeof(msg)-1) == -1) {
+    }
+    uint64_t one = 1;
+    for (int i=0; i < _nworkers; i++) {
+        if (write(_workers[i].wakefd, &one, sizeof(one)) == -1) {
+        }
+    }
+    errno = tmp_errno;
 }
 void handle_sigchld(int sig) {
     int tmp_errno = errno;
@@ -200,51 +897,331 @@ void handle_sigchld(int sig) {
     errno = tmp_errno;
 }
 
+// Update read/write interest of client to match its output queue.
+static void update_client_events(clientctx_t *ctx) {
+    if (_ring != NULL) {
+        // Pausing reads cancels the multishot recv, resuming re-arms it.
+        if (ctx->read_paused && ctx->recv_armed && !ctx->recv_cancelling) {
+            uring_prep_cancel(_ring, UDATA(ctx, UOP_RECV), UDATA(NULL, UOP_CANCEL));
+            ctx->recv_cancelling = 1;
+        } else if (!ctx->read_paused && !ctx->recv_armed) {
+            uring_arm_recv(ctx);
+        }
+        return;
+    }
+
+    int events = 0;
+    if (!ctx->read_paused)
+        events |= EV_READ;
+    if (ctx->outq->count > 0)
+        events |= EV_WRITE;
+    evloop_mod(_loop, ctx->fd, events);
+}
+
+// Queue rb to be sent to client, writing immediately if nothing else is
+// queued. The queue takes its own reference to rb.
+// Returns 0 on success, -1 if the client was disconnected.
+int send_to_client(clientctx_t *ctx, rbuf_t *rb) {
+    if (ctx->outq->nbytes + rb->len > OUTQ_MAXBYTES) {
+        log_warn("Client %d too slow, disconnecting.", ctx->fd);
+        disconnect_client(ctx->fd);
+        return -1;
+    }
+
+    int was_empty = (ctx->outq->count == 0);
+    outq_push(ctx->outq, rb);
+    if (was_empty)
+        return flush_client(ctx);
+
+    if (!ctx->read_paused && ctx->outq->nbytes > OUTQ_HIWAT) {
+        ctx->read_paused = 1;
+        update_client_events(ctx);
+    }
+    return 0;
+}
+
+// Return SENDFMT_* of messages sent to ctx.
+static inline int send_fmt(clientctx_t *ctx) {
+    if (ctx->msgver == MSGVER_COMPACT && (ctx->peerflags & MSG_FLAG_LZ))
+        return SENDFMT_LZ;
+    return ctx->msgver;
+}
+
+// Queue rb to every connected client except sender.
+// Iterates from the end of the dense fd list so that a recipient being
+// disconnected (swapped out of the list) doesn't cause others to be skipped.
+// Clients get the message in the format of their protocol version,
+// compressed if they accept it. It is re-encoded (and compressed) at most
+// once per format, when first needed, not once per client.
+void broadcast(clientctx_t *sender, rbuf_t *rb) {
+    rbuf_t *byfmt[SENDFMT_COUNT] = {NULL};
+    int fmt = msg_ver(rb->p);
+    if (fmt == MSGVER_COMPACT && (rb->p[0] & MSG_FLAG_LZ))
+        fmt = SENDFMT_LZ;
+    byfmt[fmt] = rb;
+
+    // A compact message too short to be compressed is the same either way.
+    MsgView mv;
+    if (fmt == MSGVER_COMPACT && view_msg_header(rb->p, rb->len, &mv) == 0 && mv.bodylen < MSG_LZ_MINLEN)
+        byfmt[SENDFMT_LZ] = rb;
+
+    for (int i=_ctxs->len-1; i >= 0; i--) {
+        clientctx_t *ctx = fdtbl_get(_ctxs, _ctxs->fds[i]);
+        if (ctx == sender)
+            continue;
+        int f = send_fmt(ctx);
+        if (byfmt[f] == NULL) {
+            byfmt[f] = repack_rbuf(rb, f);
+            if (byfmt[f] == NULL)
+                continue;
+        }
+        send_to_client(ctx, byfmt[f]);
+    }
+    history_add(&_history, byfmt);
+    for (int i=0; i < SENDFMT_COUNT; i++) {
+        if (byfmt[i] != NULL && byfmt[i] != rb)
+            rbuf_unref(byfmt[i]);
+    }
+}
+
+void history_init(history_t *h, int cap, size_t maxbytes) {
+    h->ents = cap > 0 ? calloc(cap, sizeof(histent_t)) : NULL;
+    h->cap = cap;
+    h->head = 0;
+    h->len = 0;
+    h->nbytes = 0;
+    h->maxbytes = maxbytes;
+}
+
+// Set ent's encoding in format fmt to rb, taking a reference to it.
+static void histent_set(history_t *h, histent_t *ent, int fmt, rbuf_t *rb) {
+    ent->byfmt[fmt] = rbuf_ref(rb);
+    for (int i=0; i < SENDFMT_COUNT; i++) {
+        if (i != fmt && ent->byfmt[i] == rb)
+            return;
+    }
+    ent->nbytes += rb->len;
+    h->nbytes += rb->len;
+}
+
+static void history_drop_oldest(history_t *h) {
+    histent_t *ent = &h->ents[h->head];
+    for (int i=0; i < SENDFMT_COUNT; i++) {
+        if (ent->byfmt[i] != NULL)
+            rbuf_unref(ent->byfmt[i]);
+    }
+    h->nbytes -= ent->nbytes;
+    h->head = (h->head + 1) % h->cap;
+    h->len--;
+}
+
+static void history_trim(history_t *h) {
+    while (h->len > 0 && h->nbytes > h->maxbytes)
+        history_drop_oldest(h);
+}
+
+// Add a relayed message, given as its encodings by SENDFMT_* (NULL for
+// formats not made), as the newest entry.
+void history_add(history_t *h, rbuf_t **byfmt) {
+    if (h->cap == 0)
+        return;
+    if (h->len == h->cap)
+        history_drop_oldest(h);
+    histent_t *ent = &h->ents[(h->head + h->len) % h->cap];
+    memset(ent, 0, sizeof(*ent));
+    for (int i=0; i < SENDFMT_COUNT; i++) {
+        if (byfmt[i] != NULL)
+            histent_set(h, ent, i, byfmt[i]);
+    }
+    h->len++;
+    history_trim(h);
+}
+
+// Queue the last n relayed messages (a batch counts as one) to ctx, in
+// its format, without copying them: the history's rbufs are queued and
+// go out with the rest of the output queue in one writev. An entry not
+// yet encoded in the format is encoded once and kept for the next client.
+// Older entries are left out if they'd push the queue over half of
+// OUTQ_MAXBYTES, so that the replay doesn't get ctx disconnected.
+// Returns 0 on success, -1 if the client was disconnected.
+int replay_history(clientctx_t *ctx, int n) {
+    history_t *h = &_history;
+    int fmt = send_fmt(ctx);
+    if (n > h->len)
+        n = h->len;
+    if (n <= 0)
+        return 0;
+
+    // Newest first, to find where to start within the byte budget.
+    size_t budget = OUTQ_MAXBYTES/2 > ctx->outq->nbytes ? OUTQ_MAXBYTES/2 - ctx->outq->nbytes : 0;
+    size_t nbytes = 0;
+    int start = h->len;
+    for (int i=h->len-1; i >= h->len - n; i--) {
+        histent_t *ent = &h->ents[(h->head + i) % h->cap];
+        if (ent->byfmt[fmt] == NULL) {
+            rbuf_t *src = NULL;
+            for (int j=0; j < SENDFMT_COUNT && src == NULL; j++)
+                src = ent->byfmt[j];
+            rbuf_t *rb = repack_rbuf(src, fmt);
+            if (rb == NULL)
+                continue;
+            histent_set(h, ent, fmt, rb);
+            rbuf_unref(rb);
+        }
+        if (nbytes + ent->byfmt[fmt]->len > budget)
+            break;
+        nbytes += ent->byfmt[fmt]->len;
+        start = i;
+    }
+
+    // ctx is gone as soon as a send fails.
+    int fd = ctx->fd;
+    int nsent = 0;
+    int z = 0;
+    for (int i=start; i < h->len; i++) {
+        histent_t *ent = &h->ents[(h->head + i) % h->cap];
+        if (ent->byfmt[fmt] == NULL)
+            continue;
+        z = send_to_client(ctx, ent->byfmt[fmt]);
+        if (z == -1)
+            break;
+        nsent++;
+    }
+    METRIC_ADD(replayed, nsent);
+    log_info("Client %d replayed %d of %d messages asked for", fd, nsent, n);
+
+    // Encodings made above count against the byte limit too.
+    history_trim(h);
+    return z;
+}
+
+// Return new rbuf with message in rb re-encoded in format fmt
+// (SENDFMT_*), or NULL if rb doesn't hold a valid message.
+// Replays run while a received batch is still being walked in
+// _inflatebuf, so rb is inflated into a buffer of its own.
+rbuf_t *repack_rbuf(rbuf_t *rb, int fmt) {
+    MsgView mv, plain;
+    buf_clear(_repackbuf);
+    if (view_msg_bytes(rb->p, rb->len, &mv) != 0 || msg_inflate(&mv, _repackbuf, &plain) != 0)
+        return NULL;
+    buf_clear(_packbuf);
+    int z;
+    if (fmt == SENDFMT_LZ)
+        z = repack_msg_flags(&plain, MSGVER_COMPACT, MSG_FLAG_LZ, _packbuf);
+    else
+        z = repack_msg(&plain, fmt, _packbuf);
+    if (z == -1)
+        return NULL;
+    return rbuf_new_copy(buf_data(_packbuf), buf_datalen(_packbuf));
+}
+
+// Write as much of client's output queue as the socket accepts.
+// Returns 0 on success, -1 if the client was disconnected.
+// With io_uring, the client is only marked to be flushed at the end of
+// the current completion batch (see uring_flush_dirty()).
+int flush_client(clientctx_t *ctx) {
+    if (_ring != NULL) {
+        if (!ctx->flush_pending) {
+            ctx->flush_pending = 1;
+            ctx->uring_refs++;
+            array_add(_dirty, ctx);
+        }
+        return 0;
+    }
+
+    size_t nbytes = ctx->outq->nbytes;
+    int z = outq_flush(ctx->fd, ctx->outq);
+    METRIC_ADD(bytes_out, nbytes - ctx->outq->nbytes);
+    if (z == Z_ERR) {
+        print_error("outq_flush()");
+        disconnect_client(ctx->fd);
+        return -1;
+    }
+    update_client_watermarks(ctx);
+    return 0;
+}
+
+// Pause or resume reading from client depending on how much output is
+// still queued to it.
+static void update_client_watermarks(clientctx_t *ctx) {
+    if (ctx->outq->nbytes > OUTQ_HIWAT)
+        ctx->read_paused = 1;
+    else if (ctx->outq->nbytes <= OUTQ_LOWAT)
+        ctx->read_paused = 0;
+    update_client_events(ctx);
+}
+
 void disconnect_client(int fd) {
-    FD_CLR(fd, &_readfds);
+    if (_ring != NULL) {
+        // Queued sqes still refer to fd by number, submit them before the
+        // number can be reused. Shutdown ends the multishot recv.
+        uring_submit_and_wait(_ring, 0);
+    } else {
+        evloop_del(_loop, fd);
+    }
     shutdown(fd, SHUT_RDWR);
-    delete_clientctx(_ctxs, fd);
-    printf("Disconnected client %d\n", fd);
+    close(fd);
+    fdtbl_del(_ctxs, fd);
+    METRIC_INC(conns_closed);
+    log_info("Disconnected client %d", fd);
 }
 
 clientctx_t *clientctx_new(int fd) {
-    clientctx_t *ctx = malloc(sizeof(clientctx_t));
+    clientctx_t *ctx = pool_alloc(_ctxpool);
     ctx->fd = fd;
     ctx->readbuf = buf_new(0);
     ctx->recvstate = RECV_SIG;
+    ctx->outq = outq_new(0);
+    ctx->outq->latency = &_metrics->queue_ns;
+    ctx->read_paused = 0;
+    ctx->msgver = MSGVER_FIXED;
+    ctx->peerflags = 0;
+    ctx->crc = 0;
+    ctx->crclen = 0;
+    ctx->resync = 0;
+    ctx->uring_refs = 0;
+    ctx->closed = 0;
+    ctx->recv_armed = 0;
+    ctx->recv_cancelling = 0;
+    ctx->flush_pending = 0;
+    ctx->send_inflight = 0;
     return ctx;
 }
+// Free ctx. With io_uring, ops still in flight may refer to ctx and its
+// output buffers, so it is only marked closed until they complete.
 void clientctx_free(clientctx_t *ctx) {
+    if (ctx->uring_refs > 0) {
+        ctx->closed = 1;
+        return;
+    }
     buf_free(ctx->readbuf);
-    free(ctx);
+    outq_free(ctx->outq);
+    pool_release(_ctxpool, ctx);
 }
 void clientctx_reset(clientctx_t *ctx) {
     buf_clear(ctx->readbuf);
     ctx->recvstate = RECV_SIG;
+    ctx->resync = 0;
 }
-clientctx_t *find_clientctx(array_t *ctxs, int fd) {
-    for (int i=0; i < ctxs->len; i++) {
-        clientctx_t *ctx = (clientctx_t *) ctxs->items[i];
-        if (ctx->fd == fd)
-            return ctx;
-    }
-    return NULL;
-}
-void delete_clientctx(array_t *ctxs, int fd) {
-    for (int i=0; i < _ctxs->len; i++) {
-        clientctx_t *ctx = _ctxs->items[i];
-        if (ctx->fd == fd) {
-            array_del(_ctxs, i);
-            break;
-        }
-    }
-}
-
 void print_buf(buf_t *buf) {
-    printf("buf (%ld bytes):", buf->len);
-    for (int i=0; i < buf->len; i++) {
+    printf("buf (%ld bytes):", buf_datalen(buf));
+    for (int i=buf->cur; i < buf->len; i++) {
         printf("%c", buf->p[i]);
     }
     printf("\n");
 }
 
+// Print the calling worker's pool and history occupancy.
+void print_pool_stats() {
+    if (_ctxpool == NULL)
+        return;
+    str_t *stats = str_new(0);
+    char line[128];
+    snprintf(line, sizeof(line), "worker %d:\n", _worker->id);
+    str_append(stats, line);
+    pool_print_stats(_ctxpool, stats);
+    snprintf(line, sizeof(line), "history: entries=%d bytes=%zu\n", _history.len, _history.nbytes);
+    str_append(stats, line);
+    printf("%s", stats->s);
+    str_free(stats);
+}
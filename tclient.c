@@ -5,126 +5,703 @@
 #include <errno.h>
 #include <assert.h>
 #include <signal.h>
-#include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include "clib.h"
 #include "cnet.h"
+#include "evloop.h"
 #include "msg.h"
 
-ssize_t sendbytes(int sock, char *buf, size_t count);
-ssize_t recvbytes(int sock, char *buf, size_t count);
+// Load generator for the t server.
+//
+// Opens nconns sending connections spread over nthreads threads, plus one
+// observer connection per thread that only receives. Every message sent
+// carries its thread, connection and send time; the server broadcasts it
+// to all other connections, and when the sending thread's observer sees it
+// come back the end-to-end latency is recorded.
+//
+// Closed loop (rate 0): each connection keeps up to depth messages in
+// flight, sending another as each one is observed.
+// Open loop (rate > 0): each connection sends rate msgs/sec on a fixed
+// schedule regardless of replies. Latency is measured from the scheduled
+// send time so that a stalled server can't hide its queueing delay.
+//
+// Batching (batch > 1): messages are coalesced into batch frames, which are
+// sent when they reach batch messages or flush_us after their first
+// message, whichever comes first.
+//
+// Compression (lz): connections accept compressed messages in their hello,
+// and compress large messages once the server's hello accepts them too.
+//
+// Replay (replay > 0): each observer asks the server for its last replay
+// relayed messages on connecting, and counts the load messages among them,
+// told apart by send times before the run started.
+
+// Message kinds for the mix.
+enum MsgKind {
+    KIND_TEXT,      // short TextMsg
+    KIND_LONG,      // TextMsg with full length text
+    KIND_JUNK,      // junk bytes followed by a TextMsg (forces resync)
+    KIND_INVALID,   // unsupported msgno, dropped by server
+    KIND_CORRUPT,   // TextMsg with a byte changed after checksumming, dropped by server
+    KIND_REPLAY,    // ReplayMsg for no messages, batched with text; never relayed
+    KIND_COUNT
+};
+static const char *_kindnames[] = {"text", "long", "junk", "invalid", "corrupt", "replay"};
+
+typedef struct loadthread loadthread_t;
+
+typedef struct {
+    int fd;
+    int idx;
+    int observer;
+    buf_t *readbuf;
+    buf_t *writebuf;
+    int inflight;
+    uint64_t next_send;     // open loop: scheduled time of next message
+    MsgBatch batch;         // open batch at end of writebuf
+    int msgflags;           // MSG_FLAG_* of compact headers sent
+    int hello_seen;         // server's hello read, or none expected
+    uint64_t flush_at;      // deadline of open batch, 0 if none open
+    loadthread_t *t;
+} loadconn_t;
+
+struct loadthread {
+    int id;
+    pthread_t thread;
+    evloop_t *loop;
+    loadconn_t *conns;
+    int nconns;
+    loadconn_t observer;
+    unsigned int seed;
+    int sending;
+
+    buf_t *inflatebuf;      // scratch for decompressed messages
+
+    hist_t latency;
+    uint64_t nsent;         // messages expected back
+    uint64_t nsent_invalid;
+    uint64_t nsent_requests;
+    uint64_t nobserved;
+    uint64_t nreplayed;
+    uint64_t nbytes_in;
+    uint64_t nerrors;
+};
+
+typedef struct {
+    char *host;
+    char *port;
+    int nconns;
+    int nthreads;
+    double duration;
+    double rate;            // per connection msgs/sec, 0 for closed loop
+    int depth;
+    int mix[KIND_COUNT];    // weights
+    int mixtotal;
+    int msgver;             // MSGVER_* to send
+    int msgflags;           // MSG_FLAG_* of compact headers
+    int lz;                 // compress messages if the server accepts it
+    int replay;             // messages of history the observers ask for
+    int batch;              // max messages per batch frame, 1 for no batching
+    int flush_us;           // max time a message waits in an open batch
+} loadopts_t;
+
+loadopts_t _opts = {"127.0.0.1", "8001", 8, 2, 5.0, 0, 1, {1, 0, 0, 0, 0, 0}, 1, MSGVER_DEFAULT, 0, 0, 0, 1, 100};
+pthread_barrier_t _start_barrier;
+uint64_t _run_start;        // messages stamped before are from earlier runs
+
+void *loadthread_run(void *arg);
+int parse_mix(char *s);
+void on_conn_event(evloop_t *loop, int fd, int events, void *ctx);
+void queue_msg(loadconn_t *c, uint64_t stamp);
+void end_batch(loadconn_t *c);
+void flush_conn(loadconn_t *c);
+void close_conn(loadconn_t *c);
+void read_hello(loadconn_t *c);
+void process_observed(loadconn_t *c);
+void observe_msg(loadthread_t *t, MsgView *mv, uint64_t now);
+int print_report(loadthread_t *threads, double secs);
 
 int main(int argc, char *argv[]) {
     int z;
-    int s0;
-    struct sockaddr sa;
-    str_t *serveripaddr = str_new(0);
 
-    if (argc < 3) {
-        printf("Usage: tclient <server domain> <port>\n");
-        printf("Ex. tclient 127.0.0.1 5000\n");
+    while ((z = getopt(argc, argv, "c:t:d:r:p:m:v:kzR:b:u:")) != -1) {
+        if (z == 'c') {
+            _opts.nconns = atoi(optarg);
+        } else if (z == 't') {
+            _opts.nthreads = atoi(optarg);
+        } else if (z == 'd') {
+            _opts.duration = atof(optarg);
+        } else if (z == 'r') {
+            _opts.rate = atof(optarg);
+        } else if (z == 'p') {
+            _opts.depth = atoi(optarg);
+        } else if (z == 'm' && parse_mix(optarg) == 0) {
+        } else if (z == 'v' && strcmp(optarg, "0.9") == 0) {
+            _opts.msgver = MSGVER_FIXED;
+        } else if (z == 'v' && strcmp(optarg, "1.0") == 0) {
+            _opts.msgver = MSGVER_VARLEN;
+        } else if (z == 'v' && strcmp(optarg, "2.0") == 0) {
+            _opts.msgver = MSGVER_COMPACT;
+        } else if (z == 'k') {
+            _opts.msgflags |= MSG_FLAG_CRC;
+        } else if (z == 'z') {
+            _opts.lz = 1;
+        } else if (z == 'R') {
+            _opts.replay = atoi(optarg);
+        } else if (z == 'b') {
+            _opts.batch = atoi(optarg);
+        } else if (z == 'u') {
+            _opts.flush_us = atoi(optarg);
+        } else {
+            printf("Usage: tclient [-c conns] [-t threads] [-d secs] [-r rate] [-p depth] [-m mix] [-v ver] [-k] [-z] [-R n] [-b batch] [-u usecs] [host [port]]\n");
+            printf("  -r  msgs/sec per connection (open loop), 0 for closed loop (default)\n");
+            printf("  -p  messages in flight per connection in closed loop (default 1)\n");
+            printf("  -m  message mix as kind=weight,... with kinds text, long, junk, invalid, corrupt, replay\n");
+            printf("  -v  protocol version to send, 0.9 (fixed size), 1.0 (default) or 2.0 (compact headers)\n");
+            printf("  -k  append CRC32C checksums to messages (2.0 only)\n");
+            printf("  -z  compress large messages and batches both ways (2.0 only)\n");
+            printf("  -R  observers ask for the last n relayed messages before the run\n");
+            printf("  -b  max messages per batch frame, 1 for no batching (default, 1.0 and 2.0 only)\n");
+            printf("  -u  usecs a message may wait for its batch to fill (default 100)\n");
+            printf("Ex. tclient -c 16 -t 4 -p 8 -m text=8,long=1,junk=1 127.0.0.1 8001\n");
+            exit(1);
+        }
+    }
+    if (optind < argc)
+        _opts.host = argv[optind++];
+    if (optind < argc)
+        _opts.port = argv[optind++];
+    if (_opts.nthreads < 1)
+        _opts.nthreads = 1;
+    if (_opts.nconns < _opts.nthreads)
+        _opts.nconns = _opts.nthreads;
+    if (_opts.depth < 1)
+        _opts.depth = 1;
+    if (_opts.batch > MSG_BATCH_MAX)
+        _opts.batch = MSG_BATCH_MAX;
+    if (_opts.batch < 1 || _opts.msgver == MSGVER_FIXED)
+        _opts.batch = 1;
+    if (_opts.msgver == MSGVER_COMPACT && _opts.mix[KIND_JUNK] > 0) {
+        printf("junk can't be sent with -v 2.0, compact headers have no signature to resync on\n");
         exit(1);
     }
+    if (_opts.msgflags != 0 && _opts.msgver != MSGVER_COMPACT) {
+        printf("-k needs -v 2.0\n");
+        exit(1);
+    }
+    if (_opts.lz && _opts.msgver != MSGVER_COMPACT) {
+        printf("-z needs -v 2.0\n");
+        exit(1);
+    }
+    if (_opts.mix[KIND_CORRUPT] > 0 && !(_opts.msgflags & MSG_FLAG_CRC)) {
+        printf("corrupt needs checksums (-k)\n");
+        exit(1);
+    }
+    if (_opts.flush_us < 0)
+        _opts.flush_us = 0;
 
-    char *server_host = argv[1];
-    char *server_port = argv[2];
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
 
-    s0 = open_connect_sock(server_host, server_port, &sa);
-    if (s0 == -1) {
-        print_error("open_connect_sock()");
-        return 1;
+    loadthread_t *threads = calloc(_opts.nthreads, sizeof(loadthread_t));
+    pthread_barrier_init(&_start_barrier, NULL, _opts.nthreads + 1);
+    for (int i=0; i < _opts.nthreads; i++) {
+        loadthread_t *t = &threads[i];
+        t->id = i;
+        t->seed = i + 1;
+        // Spread connections evenly.
+        t->nconns = _opts.nconns / _opts.nthreads + (i < _opts.nconns % _opts.nthreads);
+        z = pthread_create(&t->thread, NULL, loadthread_run, t);
+        if (z != 0) {
+            errno = z;
+            panic_err("pthread_create()");
+        }
     }
-    get_ipaddr_string(&sa, serveripaddr);
-    printf("Connected to %s:%s.\n", serveripaddr->s, server_port);
 
-    char *skipchars = "some chars to skip some chars to skip some chars to skip some chars to skip";
-    sendbytes(s0, skipchars, strlen(skipchars));
+    // Wait for all connections, then give the server time to register them
+    // before anyone sends.
+    pthread_barrier_wait(&_start_barrier);
+    usleep(200000);
+    uint64_t t0 = clock_ns();
+    _run_start = t0;
+    pthread_barrier_wait(&_start_barrier);
 
-    TextMsg tm;
-    tm.msgno = TEXTMSG_NO;
-    strcpy(tm.alias, "rob");
-    strcpy(tm.text, "This is a song that took me a long time to write...");
+    for (int i=0; i < _opts.nthreads; i++)
+        pthread_join(threads[i].thread, NULL);
+    double secs = (clock_ns() - t0) / 1e9;
 
-    char *msgbs = pack_msg(&tm);
-    assert(msgbs != NULL);
-    send(s0, msgbs, MSG_HEADER_LEN + TEXTMSG_LEN, 0);
+    return print_report(threads, secs) == 0 ? 0 : 1;
+}
 
-    sleep(1);
+// Parse mix option: kind=weight,... (weight defaults to 1).
+// Returns 0 on success or -1 for error.
+int parse_mix(char *s) {
+    memset(_opts.mix, 0, sizeof(_opts.mix));
+    _opts.mixtotal = 0;
 
-    sendbytes(s0, skipchars, strlen(skipchars));
-    strcpy(tm.text, "Life is a flower so precious in your hand...");
-    msgbs = pack_msg(&tm);
-    assert(msgbs != NULL);
-    send(s0, msgbs, MSG_HEADER_LEN + TEXTMSG_LEN, 0);
+    char *saveptr;
+    for (char *tok = strtok_r(s, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(tok, '=');
+        int weight = 1;
+        if (eq != NULL) {
+            *eq = 0;
+            weight = atoi(eq+1);
+        }
+        int kind;
+        for (kind=0; kind < KIND_COUNT; kind++) {
+            if (strcmp(tok, _kindnames[kind]) == 0)
+                break;
+        }
+        if (kind == KIND_COUNT || weight < 0)
+            return -1;
+        _opts.mix[kind] += weight;
+        _opts.mixtotal += weight;
+    }
+    return _opts.mixtotal > 0 ? 0 : -1;
+}
 
-    sleep(2);
+static int open_conn(loadthread_t *t, loadconn_t *c, int idx, int observer) {
+    struct sockaddr sa;
+    c->fd = open_connect_sock(_opts.host, _opts.port, &sa);
+    if (c->fd == -1)
+        return -1;
+    set_sock_nonblocking(c->fd);
+    set_sock_nodelay(c->fd);
+    c->idx = idx;
+    c->observer = observer;
+    c->readbuf = buf_new(0);
+    c->writebuf = buf_new(0);
+    c->inflight = 0;
+    c->next_send = 0;
+    c->msgflags = _opts.msgflags;
+    c->hello_seen = observer || _opts.msgver != MSGVER_COMPACT;
+    batch_init(&c->batch, _opts.msgver == MSGVER_FIXED ? MSGVER_VARLEN : _opts.msgver, c->msgflags);
+    c->flush_at = 0;
+    c->t = t;
+    return evloop_add(t->loop, c->fd, EV_READ, on_conn_event, c);
+}
 
-    str_free(serveripaddr);
-    close(s0);
-    return 0;
+// Closed loop: top up connection to depth messages in flight.
+static void fill_conn(loadconn_t *c) {
+    while (c->inflight < _opts.depth)
+        queue_msg(c, clock_ns());
+    flush_conn(c);
 }
 
-// Send count buf bytes into sock.
-// Returns num bytes sent or -1 for error
-ssize_t sendbytes(int sock, char *buf, size_t count) {
-    int nsent = 0;
-    while (nsent < count) {
-        int z = send(sock, buf+nsent, count-nsent, 0);
-        printf("sendbytes() z: %d\n", z);
-        // socket closed, no more data
-        if (z == 0) {
-            // socket closed
-            break;
+void *loadthread_run(void *arg) {
+    loadthread_t *t = arg;
+    t->loop = evloop_new();
+    t->conns = calloc(t->nconns, sizeof(loadconn_t));
+    t->inflatebuf = buf_new(0);
+
+    for (int i=0; i < t->nconns; i++) {
+        if (open_conn(t, &t->conns[i], i, 0) == -1)
+            panic_err("open_conn()");
+    }
+    if (open_conn(t, &t->observer, -1, 1) == -1)
+        panic_err("open_conn()");
+
+    // Observer sends one message so that the server knows its protocol
+    // version. The text doesn't parse as a load message, so it's ignored.
+    // With 2.0 every connection starts with a hello instead.
+    if (_opts.msgver == MSGVER_COMPACT) {
+        int accept = _opts.lz ? MSG_FLAG_LZ : 0;
+        for (int i=0; i < t->nconns; i++) {
+            pack_hello("tclient", accept, t->conns[i].writebuf);
+            flush_conn(&t->conns[i]);
         }
-        // interrupt occured during send, retry send.
-        if (z == -1 && errno == EINTR) {
-            continue;
+        pack_hello("tclient", accept, t->observer.writebuf);
+    } else {
+        TextMsg hello;
+        memset(&hello, 0, sizeof(hello));
+        hello.msgno = TEXTMSG_NO;
+        strcpy(hello.alias, "load");
+        strcpy(hello.text, "hello");
+        pack_msg_buf_ver(&hello, _opts.msgver, t->observer.writebuf);
+    }
+    if (_opts.replay > 0) {
+        ReplayMsg rm;
+        memset(&rm, 0, sizeof(rm));
+        rm.msgno = REPLAYMSG_NO;
+        snprintf(rm.count, sizeof(rm.count), "%d", _opts.replay);
+        pack_msg_buf_ver(&rm, _opts.msgver, t->observer.writebuf);
+    }
+    flush_conn(&t->observer);
+
+    pthread_barrier_wait(&_start_barrier);
+    pthread_barrier_wait(&_start_barrier);
+
+    uint64_t now = clock_ns();
+    uint64_t end = now + (uint64_t) (_opts.duration * 1e9);
+    uint64_t drain_end = 0;
+    uint64_t interval = _opts.rate > 0 ? (uint64_t) (1e9 / _opts.rate) : 0;
+
+    t->sending = 1;
+    for (int i=0; i < t->nconns; i++) {
+        loadconn_t *c = &t->conns[i];
+        // Stagger open loop schedules across the interval.
+        c->next_send = now + interval * i / t->nconns;
+        if (interval == 0)
+            fill_conn(c);
+    }
+
+    while (1) {
+        now = clock_ns();
+        if (t->sending && now >= end) {
+            t->sending = 0;
+            drain_end = now + 2000000000;
         }
-        // no data available at the moment, just return what we have.
-        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (!t->sending && (t->nobserved >= t->nsent || now >= drain_end))
             break;
+
+        uint64_t next = now + 10000000;
+        if (t->sending && interval > 0) {
+            for (int i=0; i < t->nconns; i++) {
+                loadconn_t *c = &t->conns[i];
+                if (c->fd == -1)
+                    continue;
+                while (c->next_send <= now) {
+                    queue_msg(c, c->next_send);
+                    c->next_send += interval;
+                }
+                flush_conn(c);
+                if (c->next_send < next)
+                    next = c->next_send;
+            }
         }
-        // any other error
-        if (z == -1) {
-            return z;
+
+        // Send batches whose deadline has passed. A deadline under 1ms
+        // away polls without blocking, so that flush_us is kept.
+        for (int i=0; i < t->nconns; i++) {
+            loadconn_t *c = &t->conns[i];
+            if (c->fd == -1 || c->flush_at == 0)
+                continue;
+            if (c->flush_at <= now) {
+                end_batch(c);
+                flush_conn(c);
+            } else if (c->flush_at < next) {
+                next = c->flush_at;
+            }
         }
-        nsent += z;
+
+        int timeout_ms = next > now ? (next - now) / 1000000 : 0;
+        if (evloop_run_once(t->loop, timeout_ms) == -1)
+            break;
+    }
+
+    for (int i=0; i < t->nconns; i++)
+        close_conn(&t->conns[i]);
+    close_conn(&t->observer);
+    evloop_free(t->loop);
+    free(t->conns);
+    buf_free(t->inflatebuf);
+    return NULL;
+}
+
+// Add msg to c's open batch, starting its flush deadline if it's the
+// first, and close the batch once full.
+static void add_to_batch(loadconn_t *c, void *msg) {
+    int n = batch_add(&c->batch, c->writebuf, msg);
+    if (n == 1)
+        c->flush_at = clock_ns() + (uint64_t) _opts.flush_us * 1000;
+    if (n >= _opts.batch)
+        end_batch(c);
+}
+
+// Append one message of a kind picked from the mix to c's write buffer.
+// stamp is the send time carried in the message.
+void queue_msg(loadconn_t *c, uint64_t stamp) {
+    loadthread_t *t = c->t;
+    int r = rand_r(&t->seed) % _opts.mixtotal;
+    int kind = 0;
+    while (r >= _opts.mix[kind]) {
+        r -= _opts.mix[kind];
+        kind++;
     }
 
-    return nsent;
+    TextMsg tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.msgno = TEXTMSG_NO;
+    strcpy(tm.alias, "load");
+    int n = snprintf(tm.text, sizeof(tm.text), "%d %d %lu ", t->id, c->idx, stamp);
+    if (kind == KIND_LONG)
+        memset(tm.text + n, 'x', TEXTMSG_TEXT_LEN - n - 1);
+
+    // A request goes in the batch with the text around it, where the
+    // server must pick it out rather than relay it.
+    if (kind == KIND_REPLAY) {
+        ReplayMsg rm;
+        memset(&rm, 0, sizeof(rm));
+        rm.msgno = REPLAYMSG_NO;
+        strcpy(rm.count, "0");
+        if (_opts.batch > 1)
+            add_to_batch(c, &rm);
+        else
+            pack_msg_buf_flags(&rm, _opts.msgver, c->msgflags, c->writebuf);
+        t->nsent_requests++;
+        return;
+    }
+
+    if (_opts.batch > 1 && (kind == KIND_TEXT || kind == KIND_LONG)) {
+        add_to_batch(c, &tm);
+        c->inflight++;
+        t->nsent++;
+        return;
+    }
+
+    // Other kinds go out as separate frames after any open batch.
+    end_batch(c);
+    if (kind == KIND_JUNK) {
+        char junk[] = "junk bytes without a signature";
+        buf_append(c->writebuf, junk, sizeof(junk)-1);
+    }
+    // Appending may compact writebuf, so locate the frame from buf_data().
+    // An invalid msgno is patched in after packing, so it goes without a
+    // checksum rather than with a wrong one.
+    size_t start = buf_datalen(c->writebuf);
+    int flags = kind == KIND_INVALID ? 0 : c->msgflags;
+    int msglen = pack_msg_buf_flags(&tm, _opts.msgver, flags, c->writebuf);
+    if (kind == KIND_CORRUPT) {
+        buf_data(c->writebuf)[start + msglen - MSG_CRC_LEN - 1] ^= 1;
+        t->nsent_invalid++;
+        return;
+    }
+    if (kind == KIND_INVALID) {
+        char *bs = buf_data(c->writebuf) + start;
+        if (_opts.msgver == MSGVER_COMPACT)
+            bs[1] = 127;    // unused msgno that keeps the one byte varint
+        else
+            MSG_WIRE(bs)->msgno = htons(999);
+        t->nsent_invalid++;
+        return;
+    }
+    c->inflight++;
+    t->nsent++;
 }
 
-// Receive count bytes into buf.
-// Returns num bytes received or -1 for error.
-ssize_t recvbytes(int sock, char *buf, size_t count) {
-    memset(buf, '*', count); // initialize for debugging purposes.
+// Close c's open batch so that it can be sent.
+void end_batch(loadconn_t *c) {
+    batch_end(&c->batch, c->writebuf);
+    c->flush_at = 0;
+}
 
-    int nread = 0;
-    while (nread < count) {
-        int z = recv(sock, buf+nread, count-nread, 0);
-        // socket closed, no more data
-        if (z == 0) {
+// Write as much of c's write buffer, up to any open batch, as the socket
+// accepts.
+void flush_conn(loadconn_t *c) {
+    if (c->fd == -1)
+        return;
+    buf_t *wb = c->writebuf;
+    while (1) {
+        size_t len = c->batch.count > 0 ? c->batch.start : buf_datalen(wb);
+        if (len == 0)
             break;
-        }
-        // interrupt occured during read, retry read.
-        if (z == -1 && errno == EINTR) {
+        ssize_t z = send(c->fd, buf_data(wb), len, MSG_NOSIGNAL);
+        if (z == -1 && errno == EINTR)
             continue;
+        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (z == -1) {
+            close_conn(c);
+            return;
+        }
+        buf_stripleft(wb, z);
+        if (c->batch.count > 0)
+            c->batch.start -= z;
+    }
+    size_t pending = c->batch.count > 0 ? c->batch.start : buf_datalen(wb);
+    evloop_mod(c->t->loop, c->fd, pending > 0 ? EV_READ | EV_WRITE : EV_READ);
+}
+
+void close_conn(loadconn_t *c) {
+    if (c->fd == -1)
+        return;
+    evloop_del(c->t->loop, c->fd);
+    close(c->fd);
+    c->fd = -1;
+    buf_free(c->readbuf);
+    buf_free(c->writebuf);
+}
+
+void on_conn_event(evloop_t *loop, int fd, int events, void *ctx) {
+    loadconn_t *c = ctx;
+    loadthread_t *t = c->t;
+    char discard[65536];
+
+    if (events & EV_WRITE)
+        flush_conn(c);
+    if (c->fd == -1)
+        return;
+
+    // Sending connections get every other connection's broadcasts too;
+    // they must be read but only the observer looks at them, past the
+    // server's hello.
+    while (1) {
+        int z;
+        size_t nread = 0;
+        if (c->observer || !c->hello_seen) {
+            z = recv_buf_readv(fd, c->readbuf, discard, sizeof(discard), &nread);
+        } else {
+            ssize_t n = recv(fd, discard, sizeof(discard), 0);
+            if (n == -1 && errno == EINTR)
+                continue;
+            z = n > 0 ? Z_OPEN : n == 0 ? Z_EOF : (errno == EAGAIN || errno == EWOULDBLOCK) ? Z_BLOCK : Z_ERR;
+            if (n > 0)
+                nread = n;
+        }
+        t->nbytes_in += nread;
+        if (c->observer && nread > 0)
+            process_observed(c);
+        else if (!c->hello_seen && nread > 0)
+            read_hello(c);
+        if (z == Z_EOF || z == Z_ERR) {
+            t->nerrors++;
+            close_conn(c);
+            return;
         }
-        // no data available at the moment, just return what we have.
-        if (z == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (z == Z_BLOCK)
+            break;
+    }
+}
+
+// Look for the server's hello at the start of what c received, and
+// compress from then on if asked to and the server accepts it.
+void read_hello(loadconn_t *c) {
+    buf_t *rb = c->readbuf;
+    while (!c->hello_seen) {
+        MsgView mv;
+        int z = view_msg_bytes(buf_data(rb), buf_datalen(rb), &mv);
+        if (z == 1)
+            return;
+        if (z == -1) {
+            c->t->nerrors++;
+            c->hello_seen = 1;
             break;
         }
-        // any other error
+        if (mv.msgno == MSGNO_HELLO) {
+            c->hello_seen = 1;
+            if (_opts.lz && (hello_flags(&mv) & MSG_FLAG_LZ)) {
+                c->msgflags |= MSG_FLAG_LZ;
+                c->batch.flags = c->msgflags;
+            }
+        }
+        buf_stripleft(rb, mv.msglen);
+    }
+    // The rest are broadcasts, which senders ignore.
+    buf_clear(rb);
+}
+
+// Match broadcast messages received by the observer with this thread's
+// sends.
+void process_observed(loadconn_t *c) {
+    loadthread_t *t = c->t;
+    buf_t *rb = c->readbuf;
+    uint64_t now = clock_ns();
+
+    while (1) {
+        MsgView mv;
+        int z = view_msg_bytes(buf_data(rb), buf_datalen(rb), &mv);
+        if (z == 1)
+            break;
         if (z == -1) {
-            return z;
+            t->nerrors++;
+            buf_clear(rb);
+            break;
+        }
+        MsgView plain;
+        buf_clear(t->inflatebuf);
+        if (!msg_crc_ok(&mv) || msg_inflate(&mv, t->inflatebuf, &plain) != 0) {
+            t->nerrors++;
+            buf_stripleft(rb, mv.msglen);
+            continue;
         }
-        nread += z;
+
+        if (plain.msgno == MSGNO_BATCH) {
+            MsgView sub;
+            int off = 0;
+            while (view_batch_next(&plain, &off, &sub) == 1)
+                observe_msg(t, &sub, now);
+        } else {
+            observe_msg(t, &plain, now);
+        }
+        buf_stripleft(rb, mv.msglen);
+    }
+}
+
+// Record latency of one observed message if it's one of t's sends.
+// Requests to the server must never be relayed.
+void observe_msg(loadthread_t *t, MsgView *mv, uint64_t now) {
+    if (mv->msgno == REPLAYMSG_NO) {
+        t->nerrors++;
+        return;
     }
+    TextMsgView tv;
+    if (view_textmsg(mv, &tv) == 0) {
+        char text[64];
+        size_t len = tv.text_len < sizeof(text)-1 ? tv.text_len : sizeof(text)-1;
+        memcpy(text, tv.text, len);
+        text[len] = 0;
 
-    return nread;
+        int tid, idx;
+        unsigned long stamp;
+        int z = sscanf(text, "%d %d %lu", &tid, &idx, &stamp);
+        if (z == 3 && stamp < _run_start) {
+            t->nreplayed++;
+        } else if (z == 3 && tid == t->id && idx >= 0 && idx < t->nconns) {
+            hist_record(&t->latency, now > stamp ? now - stamp : 0);
+            t->nobserved++;
+            loadconn_t *sender = &t->conns[idx];
+            sender->inflight--;
+            if (t->sending && _opts.rate == 0 && sender->fd != -1)
+                fill_conn(sender);
+        }
+    }
 }
 
+// Returns number of errors seen.
+int print_report(loadthread_t *threads, double secs) {
+    hist_t *lat = calloc(1, sizeof(hist_t));
+    uint64_t nsent = 0, nsent_invalid = 0, nsent_requests = 0, nobserved = 0, nreplayed = 0, nbytes_in = 0, nerrors = 0;
+    for (int i=0; i < _opts.nthreads; i++) {
+        loadthread_t *t = &threads[i];
+        hist_merge(lat, &t->latency);
+        nsent += t->nsent;
+        nsent_invalid += t->nsent_invalid;
+        nsent_requests += t->nsent_requests;
+        nobserved += t->nobserved;
+        nreplayed += t->nreplayed;
+        nbytes_in += t->nbytes_in;
+        nerrors += t->nerrors;
+    }
+
+    printf("load: %d conns, %d threads, %.1fs, ", _opts.nconns, _opts.nthreads, _opts.duration);
+    if (_opts.rate > 0)
+        printf("open loop %.0f msgs/sec/conn, mix", _opts.rate);
+    else
+        printf("closed loop depth %d, mix", _opts.depth);
+    for (int k=0; k < KIND_COUNT; k++) {
+        if (_opts.mix[k] > 0)
+            printf(" %s=%d", _kindnames[k], _opts.mix[k]);
+    }
+    printf("\n");
+    printf("sent %lu msgs (+%lu invalid, +%lu requests), observed %lu, lost %lu, errors %lu\n",
+           nsent, nsent_invalid, nsent_requests, nobserved, nsent - nobserved, nerrors);
+    if (_opts.replay > 0)
+        printf("replayed %lu load msgs to %d observers (asked for %d each)\n", nreplayed, _opts.nthreads, _opts.replay);
+    printf("throughput %.0f msgs/sec, fan-out received %.1f MB/sec\n",
+           nobserved / secs, nbytes_in / secs / SIZE_MB);
+    printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           hist_percentile(lat, 50) / 1e3, hist_percentile(lat, 90) / 1e3,
+           hist_percentile(lat, 99) / 1e3, hist_percentile(lat, 99.9) / 1e3, lat->max / 1e3);
+
+    // One line for scripts comparing runs.
+    printf("RESULT msgs_per_sec=%.0f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f lost=%lu errors=%lu\n",
+           nobserved / secs, hist_percentile(lat, 50) / 1e3, hist_percentile(lat, 99) / 1e3,
+           hist_percentile(lat, 99.9) / 1e3, lat->max / 1e3, nsent - nobserved, nerrors);
+    free(lat);
+    return nerrors;
+}
@@ -9,8 +9,27 @@
 #include "clib.h"
 #include "cnet.h"
 #include "msg.h"
+#include "scan.h"
+#include "crc32c.h"
+#include "lz.h"
+
+void test_textmsg();
+void test_scan_find4();
+void test_scan_lines();
+void test_crc32c();
+void test_lz();
 
 int main(int argc, char *argv[]) {
+    test_textmsg();
+    test_scan_find4();
+    test_scan_lines();
+    test_crc32c();
+    test_lz();
+    printf("All checks passed.\n");
+    return 0;
+}
+
+void test_textmsg() {
     TextMsg tm;
 
     tm.msgno = TEXTMSG_NO;
@@ -21,6 +40,13 @@ int main(int argc, char *argv[]) {
     char *msgbs = pack_msg(&tm);
     assert(msgbs != NULL);
 
+    // pack_msg() doesn't return the length, pack the same message into a
+    // buf for it.
+    buf_t *buf = buf_new(0);
+    int msglen = pack_msg_buf(&tm, buf);
+    assert(msglen > 0 && msglen == buf_datalen(buf));
+    assert(memcmp(buf_data(buf), msgbs, msglen) == 0);
+
     printf("Unpacking textmsg bytes...\n");
     TextMsg *tm2 = unpack_msg_bytes(msgbs);
     assert(tm2 != NULL);
@@ -29,7 +55,293 @@ int main(int argc, char *argv[]) {
     printf("tm2.msgno: %d\n", tm2->msgno);
     printf("tm2.alias: '%s'\n", tm2->alias);
     printf("tm2.text: '%s'\n", tm2->text);
+    assert(tm2->msgno == TEXTMSG_NO);
+    assert(strcmp(tm2->alias, tm.alias) == 0);
+    assert(strcmp(tm2->text, tm.text) == 0);
+
+    printf("Viewing textmsg bytes...\n");
+    MsgView mv;
+    TextMsgView tv;
+    assert(view_msg_bytes(msgbs, msglen-1, &mv) == 1);
+    int z = view_msg_bytes(msgbs, msglen, &mv);
+    assert(z == 0);
+    assert(mv.msglen == msglen);
+    z = view_textmsg(&mv, &tv);
+    assert(z == 0);
+    assert(tv.alias_len == strlen(tm.alias) && memcmp(tv.alias, tm.alias, tv.alias_len) == 0);
+    assert(tv.text_len == strlen(tm.text) && memcmp(tv.text, tm.text, tv.text_len) == 0);
+    printf("mv.msgno: %d, mv.msglen: %d\n", mv.msgno, mv.msglen);
+    printf("tv.alias: '%.*s'\n", (int) tv.alias_len, tv.alias);
+    printf("tv.text: '%.*s'\n", (int) tv.text_len, tv.text);
+    free(msgbs);
+    buf_free(buf);
+}
+
+// Fill p[0..len) with bytes from set, chosen at random.
+static void fill_random(char *p, size_t len, const char *set) {
+    size_t n = strlen(set);
+    for (size_t i=0; i < len; i++)
+        p[i] = set[rand() % n];
+}
+
+// Check that every scan_find4() impl the CPU supports agrees with a
+// byte at a time search.
+static void check_find4(const char *p, size_t len, const char *k) {
+    long want = -1;
+    for (size_t i=0; i+4 <= len; i++) {
+        if (memcmp(p+i, k, 4) == 0) {
+            want = i;
+            break;
+        }
+    }
+    for (int impl=SCAN_SCALAR; impl <= SCAN_AVX2; impl++) {
+        if (scan_set_impl(impl) == -1)
+            continue;
+        long got = scan_find4(p, len, k);
+        if (got != want)
+            fprintf(stderr, "scan_find4() %s: len %zu, got %ld, want %ld\n", scan_impl_name(impl), len, got, want);
+        assert(got == want);
+    }
+}
+
+// Signatures at every offset across the 16, 32 and 64 byte blocks of the
+// SIMD scanners, among bytes that often start a partial match, and
+// partial signatures cut off by the end of the buffer.
+void test_scan_find4() {
+    printf("Checking scan_find4() impls...\n");
+    int impl = scan_impl();
+    const char *k = "abcd";
+    char buf[160];
+    srand(1);
+
+    check_find4(buf, 0, k);
+    for (size_t len=1; len <= sizeof(buf); len++) {
+        for (size_t at=0; at+4 <= len; at++) {
+            fill_random(buf, len, "abc");
+            memcpy(buf+at, k, 4);
+            check_find4(buf, len, k);
+        }
+        for (size_t n=1; n < 4 && n <= len; n++) {
+            fill_random(buf, len, "abc");
+            memcpy(buf+len-n, k, n);
+            check_find4(buf, len, k);
+        }
+        fill_random(buf, len, "abc");
+        check_find4(buf, len, k);
+    }
+    scan_set_impl(impl);
+}
+
+// Check that every scan_lines() impl the CPU supports finds the same
+// lines, up to maxlines of them, as a byte at a time scan.
+static void check_lines(const char *p, size_t len, size_t maxlines) {
+    linespan_t want[64], got[64];
+    assert(maxlines <= 64);
+    size_t nwant = 0;
+    size_t start = 0;
+    int32_t colon = -1;
+    for (size_t i=0; i < len && nwant < maxlines; i++) {
+        if (p[i] == '\n') {
+            want[nwant].off = start;
+            want[nwant].len = i - start;
+            want[nwant].colon = colon;
+            nwant++;
+            start = i+1;
+            colon = -1;
+        } else if (p[i] == ':' && colon < 0) {
+            colon = i - start;
+        }
+    }
+
+    for (int impl=SCAN_SCALAR; impl <= SCAN_AVX2; impl++) {
+        if (scan_set_impl(impl) == -1)
+            continue;
+        size_t n = scan_lines(p, len, got, maxlines);
+        if (n != nwant)
+            fprintf(stderr, "scan_lines() %s: len %zu, got %zu lines, want %zu\n", scan_impl_name(impl), len, n, nwant);
+        assert(n == nwant);
+        for (size_t i=0; i < n; i++) {
+            assert(got[i].off == want[i].off);
+            assert(got[i].len == want[i].len);
+            assert(got[i].colon == want[i].colon);
+        }
+    }
+}
+
+// A newline or colon at every offset across the 16 and 64 byte blocks of
+// the SIMD scanners, an unterminated last line, and random lines, some
+// cut short by maxlines.
+void test_scan_lines() {
+    printf("Checking scan_lines() impls...\n");
+    int impl = scan_impl();
+    char buf[160];
+    srand(1);
+
+    check_lines(buf, 0, 64);
+    for (size_t len=1; len <= sizeof(buf); len++) {
+        for (size_t at=0; at < len; at++) {
+            memset(buf, 'a', len);
+            buf[at] = '\n';
+            check_lines(buf, len, 64);
+            buf[at] = ':';
+            buf[len-1] = '\n';
+            check_lines(buf, len, 64);
+        }
+        for (int i=0; i < 20; i++) {
+            fill_random(buf, len, i % 2 ? "ab:\n" : "abcdefgh:\n");
+            check_lines(buf, len, 64);
+            check_lines(buf, len, 1 + rand() % 4);
+        }
+    }
+    scan_set_impl(impl);
+}
+
+// Standard check value of each crc32c() impl the CPU supports, agreement
+// between them at every length and alignment around the 8 byte steps,
+// and checksums continued across calls. Then a checksummed message with
+// one byte changed must fail msg_crc_ok().
+void test_crc32c() {
+    printf("Checking crc32c() impls...\n");
+    int impl = crc_impl();
+    char buf[512];
+    srand(1);
+    for (int i=0; i < sizeof(buf); i++)
+        buf[i] = rand();
+
+    crc_set_impl(CRC_SLICE8);
+    uint32_t want[64+1][8];
+    for (int len=0; len <= 64; len++) {
+        for (int off=0; off < 8; off++)
+            want[len][off] = crc32c(0, buf+off, len);
+    }
+
+    for (int i=CRC_SLICE8; i <= CRC_SSE42; i++) {
+        if (crc_set_impl(i) == -1)
+            continue;
+        assert(crc32c(0, "123456789", 9) == 0xe3069283);
+        assert(crc32c(0, "", 0) == 0);
+        for (int len=0; len <= 64; len++) {
+            for (int off=0; off < 8; off++)
+                assert(crc32c(0, buf+off, len) == want[len][off]);
+        }
+        uint32_t whole = crc32c(0, buf, sizeof(buf));
+        for (int n=0; n <= sizeof(buf); n += 37)
+            assert(crc32c(crc32c(0, buf, n), buf+n, sizeof(buf)-n) == whole);
+    }
+    crc_set_impl(impl);
+
+    printf("Checking message checksum...\n");
+    TextMsg tm;
+    tm.msgno = TEXTMSG_NO;
+    strcpy(tm.alias, "rob");
+    strcpy(tm.text, "checked");
+    buf_t *mbuf = buf_new(0);
+    int msglen = pack_msg_buf_flags(&tm, MSGVER_COMPACT, MSG_FLAG_CRC, mbuf);
+    assert(msglen > 0);
+
+    MsgView mv;
+    assert(view_msg_bytes(buf_data(mbuf), msglen, &mv) == 0);
+    assert(mv.flags & MSG_FLAG_CRC);
+    assert(msg_crc_ok(&mv));
+    mv.bs[msglen - MSG_CRC_LEN - 1] ^= 0x01;
+    assert(view_msg_bytes(buf_data(mbuf), msglen, &mv) == 0);
+    assert(!msg_crc_ok(&mv));
+    buf_free(mbuf);
+}
+
+// Compress n bytes at src and check that they decompress to the same,
+// that no truncation of the stream decompresses to all n bytes, and that
+// output not fitting in cap is an error.
+static void check_lz(const char *src, int n) {
+    static char c[LZ_MAXLEN + 64];
+    static char out[LZ_MAXLEN];
+    int clen = lz_compress(src, n, c, sizeof(c));
+    assert(n == 0 || clen > 0);
+    assert(lz_decompress(c, clen, out, n) == n);
+    assert(memcmp(out, src, n) == 0);
+    for (int k=0; k < clen; k++)
+        assert(lz_decompress(c, k, out, n) != n);
+    if (n > 0)
+        assert(lz_decompress(c, clen, out, n-1) == -1);
 
+    // Corrupt streams may decode to other bytes, but never past cap.
+    for (int i=0; i < clen && i < 256; i++) {
+        c[i] ^= 0x5a;
+        int z = lz_decompress(c, clen, out, n);
+        assert(z >= -1 && z <= n);
+        c[i] ^= 0x5a;
+    }
 }
 
+void test_lz() {
+    printf("Checking lz compression...\n");
+    static char src[LZ_MAXLEN];
+    srand(1);
+
+    check_lz(src, 0);
+    src[0] = 'x';
+    check_lz(src, 1);
+    for (int n=2; n <= 64; n++) {
+        fill_random(src, n, "ab");
+        check_lz(src, n);
+    }
+    fill_random(src, MSG_MAX_BODYLEN, "the quick brown fox ");
+    check_lz(src, MSG_MAX_BODYLEN);
+    memset(src, 'a', LZ_MAXLEN);        // matches overlapping their output
+    check_lz(src, LZ_MAXLEN);
+
+    // Incompressible input only fits with room for all of it.
+    for (int i=0; i < MSG_MAX_BODYLEN; i++)
+        src[i] = rand();
+    check_lz(src, MSG_MAX_BODYLEN);
+    static char c[MSG_MAX_BODYLEN];
+    assert(lz_compress(src, MSG_MAX_BODYLEN, c, MSG_MAX_BODYLEN) == 0);
+
+    // Malformed streams: literals past the end of input, a zero offset,
+    // an offset before the start of output, an overlong varint, a match
+    // longer than cap, and a last sequence claiming a match.
+    const char *bad[] = {"\x10", "\x10" "a\x00\x00", "\x10" "a\x02\x00",
+                         "\xf0\xff\xff\xff\xff\xff", "\x1f" "a\x01\x00\xff\x01", "\x11" "a"};
+    const int badlen[] = {1, 4, 4, 6, 6, 2};
+    char out[64];
+    for (int i=0; i < countof(bad); i++)
+        assert(lz_decompress(bad[i], badlen[i], out, sizeof(out)) == -1);
 
+    // A batch packed with MSG_FLAG_LZ inflates to the same batch packed
+    // without it.
+    printf("Checking compressed batch...\n");
+    buf_t *plainbuf = buf_new(0);
+    buf_t *lzbuf = buf_new(0);
+    buf_t *inflatebuf = buf_new(0);
+    MsgBatch pb, lb;
+    batch_init(&pb, MSGVER_COMPACT, 0);
+    batch_init(&lb, MSGVER_COMPACT, MSG_FLAG_LZ);
+    for (int i=0; i < 20; i++) {
+        TextMsg tm;
+        tm.msgno = TEXTMSG_NO;
+        snprintf(tm.alias, sizeof(tm.alias), "guest%d", i % 3);
+        snprintf(tm.text, sizeof(tm.text), "message %d, the same old text as always", i);
+        assert(batch_add(&pb, plainbuf, &tm) > 0);
+        assert(batch_add(&lb, lzbuf, &tm) > 0);
+    }
+    batch_end(&pb, plainbuf);
+    batch_end(&lb, lzbuf);
+
+    MsgView mv, lmv, plain;
+    assert(view_msg_bytes(buf_data(plainbuf), buf_datalen(plainbuf), &mv) == 0);
+    assert(view_msg_bytes(buf_data(lzbuf), buf_datalen(lzbuf), &lmv) == 0);
+    assert(lmv.flags & MSG_FLAG_LZ);
+    assert(lmv.msglen < mv.msglen);
+    assert(msg_inflate(&lmv, inflatebuf, &plain) == 0);
+    assert(plain.msgno == MSGNO_BATCH && !(plain.flags & MSG_FLAG_LZ));
+    assert(plain.msglen == mv.msglen && memcmp(plain.bs, mv.bs, mv.msglen) == 0);
+
+    // A wrong raw length in front of the compressed body is an error.
+    lmv.body[0] ^= 0x01;
+    buf_clear(inflatebuf);
+    assert(msg_inflate(&lmv, inflatebuf, &plain) == -1);
+
+    buf_free(plainbuf);
+    buf_free(lzbuf);
+    buf_free(inflatebuf);
+}
@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "clib.h"
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Map the sq/cq rings and sqe array of a newly set up ring.
+static int uring_mmap(uring_t *ring, struct io_uring_params *p) {
+    ring->sq_ptr_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cq_ptr_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ptr_len > ring->sq_ptr_len)
+            ring->sq_ptr_len = ring->cq_ptr_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_ptr_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        return -1;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+        ring->cq_ptr_len = 0;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_ptr_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            return -1;
+    }
+
+    ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        return -1;
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq + p->sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p->sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p->sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p->sq_off.array);
+    ring->sq_entries = p->sq_entries;
+
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + p->cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p->cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+    return 0;
+}
+
+// Allocate nbufs buffers of bufsize bytes and register them as a
+// provided buffer ring for multishot recv.
+static int uring_setup_bufs(uring_t *ring, unsigned nbufs, size_t bufsize) {
+    ring->br_entries = nbufs;
+    ring->bufsize = bufsize;
+    ring->br_len = nbufs * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED) {
+        ring->br = NULL;
+        return -1;
+    }
+    ring->bufs = malloc(nbufs * bufsize);
+    if (ring->bufs == NULL)
+        return -1;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) ring->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+
+    ring->br->tail = 0;
+    for (unsigned bid=0; bid < nbufs; bid++)
+        uring_recycle_buf(ring, bid);
+    return 0;
+}
+
+// Wait for and consume the next completion, returning its res and flags.
+// Any provided buffer it took is given back.
+static int uring_wait_cqe(uring_t *ring, int *res, unsigned *flags) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(ring)) == NULL) {
+        if (uring_submit_and_wait(ring, 1) == -1)
+            return -1;
+    }
+    *res = cqe->res;
+    *flags = cqe->flags;
+    uring_cqe_seen(ring);
+    if (*flags & IORING_CQE_F_BUFFER)
+        uring_recycle_buf(ring, *flags >> IORING_CQE_BUFFER_SHIFT);
+    return 0;
+}
+
+// Check that multishot recv works (kernel 6.0+) by running one on a
+// socketpair until it ends. Older kernels set up provided buffer rings
+// fine but fail every multishot recv with EINVAL.
+// Returns 0 if supported or -1 if not (errno set).
+static int uring_probe_recv_multishot(uring_t *ring) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+
+    int res;
+    unsigned flags;
+    int z = -1;
+    if (write(sv[1], "", 1) != 1)
+        goto done;
+    uring_prep_recv_multishot(ring, sv[0], 0);
+    if (uring_wait_cqe(ring, &res, &flags) == -1)
+        goto done;
+    if (res < 0) {
+        errno = -res;
+        goto done;
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        errno = ENOTSUP;
+        goto done;
+    }
+
+    // End the recv with EOF and reap its last completion.
+    shutdown(sv[1], SHUT_WR);
+    while (flags & IORING_CQE_F_MORE) {
+        if (uring_wait_cqe(ring, &res, &flags) == -1)
+            goto done;
+    }
+    z = 0;
+
+done:
+    {
+        int tmp_errno = errno;
+        close(sv[0]);
+        close(sv[1]);
+        errno = tmp_errno;
+    }
+    return z;
+}
+
+// Return new ring with entries sqes and a provided buffer ring of nbufs
+// (power of 2) buffers, or NULL if io_uring or any of the needed features
+// is not supported by the kernel (errno set).
+uring_t *uring_new(unsigned entries, unsigned nbufs, size_t bufsize) {
+    struct io_uring_params p;
+    assert((nbufs & (nbufs-1)) == 0);
+
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    ring->fd = -1;
+
+    // Multishot completions pile up faster than submissions, so ask for a
+    // larger completion queue.
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 8;
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 8;
+        ring->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (ring->fd == -1)
+        goto error_return;
+    if (!(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        goto error_return;
+    }
+    if (uring_mmap(ring, &p) == -1)
+        goto error_return;
+    if (uring_setup_bufs(ring, nbufs, bufsize) == -1)
+        goto error_return;
+    if (uring_probe_recv_multishot(ring) == -1)
+        goto error_return;
+    return ring;
+
+error_return:
+    {
+        int tmp_errno = errno;
+        uring_free(ring);
+        errno = tmp_errno;
+    }
+    return NULL;
+}
+void uring_free(uring_t *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr_len > 0 && ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED)
+        munmap(ring->cq_ptr, ring->cq_ptr_len);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_ptr_len);
+    if (ring->br != NULL)
+        munmap(ring->br, ring->br_len);
+    free(ring->bufs);
+    if (ring->fd != -1)
+        close(ring->fd);
+    free(ring);
+}
+
+// Return next free sqe, zeroed. Submits pending sqes first if the
+// submission queue is full.
+static struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail + ring->sq_pending;
+    if (tail - head >= ring->sq_entries) {
+        uring_submit_and_wait(ring, 0);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        tail = *ring->sq_tail + ring->sq_pending;
+        if (tail - head >= ring->sq_entries)
+            panic("uring_get_sqe() submission queue full");
+    }
+
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_pending++;
+    return sqe;
+}
+
+void uring_prep_accept_multishot(uring_t *ring, int fd, uint64_t udata) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = udata;
+}
+void uring_prep_recv_multishot(uring_t *ring, int fd, uint64_t udata) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = udata;
+}
+// mh and the iovecs it points to must stay valid until the completion.
+void uring_prep_sendmsg(uring_t *ring, int fd, struct msghdr *mh, uint64_t udata) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) mh;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = udata;
+}
+void uring_prep_read(uring_t *ring, int fd, void *buf, size_t len, uint64_t udata) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) buf;
+    sqe->len = len;
+    sqe->user_data = udata;
+}
+void uring_prep_cancel(uring_t *ring, uint64_t target_udata, uint64_t udata) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target_udata;
+    sqe->user_data = udata;
+}
+
+// Submit all prepped sqes and wait until at least min_complete
+// completions are available, in one syscall.
+// Returns 0 on success or -1 for error.
+int uring_submit_and_wait(uring_t *ring, unsigned min_complete) {
+    unsigned to_submit = ring->sq_pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+    ring->sq_pending = 0;
+
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (to_submit > 0 || min_complete > 0) {
+        int z = sys_io_uring_enter(ring->fd, to_submit, min_complete, flags);
+        if (z == -1 && errno == EINTR) {
+            if (min_complete > 0 && uring_peek_cqe(ring) != NULL)
+                return 0;
+            continue;
+        }
+        if (z == -1) {
+            print_error("io_uring_enter()");
+            return -1;
+        }
+        assert(z <= to_submit);
+        to_submit -= z;
+        if (to_submit == 0)
+            break;
+    }
+    return 0;
+}
+// Return next completion or NULL if none available.
+// Call uring_cqe_seen() when done with it.
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Return provided buffer bid that a recv completion filled.
+char *uring_buf(uring_t *ring, unsigned bid) {
+    assert(bid < ring->br_entries);
+    return ring->bufs + bid * ring->bufsize;
+}
+// Give provided buffer bid back to the kernel for reuse.
+void uring_recycle_buf(uring_t *ring, unsigned bid) {
+    unsigned short tail = ring->br->tail;
+    struct io_uring_buf *b = &ring->br->bufs[tail & (ring->br_entries-1)];
+    b->addr = (uint64_t) uring_buf(ring, bid);
+    b->len = ring->bufsize;
+    b->bid = bid;
+    __atomic_store_n(&ring->br->tail, tail+1, __ATOMIC_RELEASE);
+}
+
@@ -0,0 +1,67 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper using the raw syscalls (no liburing).
+//
+// Supports multishot accept, multishot recv into a ring of provided
+// buffers (buffer group URING_BGID), sendmsg and read. SQEs are only
+// queued by the uring_prep_*() calls and are submitted together with the
+// wait for completions in uring_submit_and_wait(), so one loop iteration
+// costs one io_uring_enter() syscall.
+
+#define URING_BGID 0
+
+typedef struct {
+    int fd;
+
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sq_pending;    // prepped sqes not yet submitted
+
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_ptr_len;
+    void *cq_ptr;
+    size_t cq_ptr_len;
+    size_t sqes_len;
+
+    // provided buffer ring for multishot recv
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    unsigned br_entries;
+    char *bufs;
+    size_t bufsize;
+} uring_t;
+
+uring_t *uring_new(unsigned entries, unsigned nbufs, size_t bufsize);
+void uring_free(uring_t *ring);
+
+void uring_prep_accept_multishot(uring_t *ring, int fd, uint64_t udata);
+void uring_prep_recv_multishot(uring_t *ring, int fd, uint64_t udata);
+void uring_prep_sendmsg(uring_t *ring, int fd, struct msghdr *mh, uint64_t udata);
+void uring_prep_read(uring_t *ring, int fd, void *buf, size_t len, uint64_t udata);
+void uring_prep_cancel(uring_t *ring, uint64_t target_udata, uint64_t udata);
+
+int uring_submit_and_wait(uring_t *ring, unsigned min_complete);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+char *uring_buf(uring_t *ring, unsigned bid);
+void uring_recycle_buf(uring_t *ring, unsigned bid);
+
+#endif
+